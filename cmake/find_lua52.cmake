@@ -38,3 +38,15 @@ target_include_directories(lua52 PRIVATE ${LUA_ROOT})
 target_include_directories(lua52 INTERFACE ${LUA_INCLUDE_DIR})
 
 add_library(lua::lib ALIAS lua52)
+
+# Standalone compiler, used to precompile embedded lua sources into bytecode
+add_executable(luac52 EXCLUDE_FROM_ALL ${LUA_SRC} ${LUA_ROOT}/luac.c)
+target_compile_definitions(luac52
+    PRIVATE
+    $<$<PLATFORM_ID:Linux>:LUA_USE_LINUX>)
+target_include_directories(luac52 PRIVATE ${LUA_ROOT})
+if(UNIX)
+    target_link_libraries(luac52 PRIVATE m)
+endif()
+
+add_executable(lua::luac ALIAS luac52)
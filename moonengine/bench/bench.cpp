@@ -0,0 +1,246 @@
+// Benchmark of moonengine and yuescript compilers over the corpus
+// Usage: moonengine_bench [--json] [--iterations N] [--parser lpeg|native|verify] [--memo on|off|both] [--incremental] [corpus directory]
+// verify mode checks native parser against LPeg grammar, mismatches are reported as failures
+// by default every moonscript file is run with and without LPeg memoization to compare both modes
+// --incremental adds runs where every iteration recompiles the file after a small edit in its middle, like autorefresh does
+// yuescript files are run with a new compiler for every file (fresh) and with the module's pooled compiler (pooled),
+// macro modules are imported relative to the corpus directory, which becomes the working directory
+
+#include <moonengine/engine.hpp>
+#include <yuescript/yue_compiler.h>
+#include "yuescript.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+
+#ifndef MOONENGINE_BENCH_CORPUS
+#define MOONENGINE_BENCH_CORPUS "corpus"
+#endif
+
+inline double timestamp() {
+    using clock = std::chrono::steady_clock;
+    using dur = std::chrono::duration<double, std::milli>;
+    return std::chrono::time_point_cast<dur>(clock::now()).time_since_epoch().count();
+}
+
+struct BenchResult {
+    std::string file;
+    std::string language;
+    std::string mode;
+    size_t bytes = 0;
+    size_t iterations = 0;
+    size_t failures = 0;
+    size_t native_parses = 0;
+    double total_time = 0; // in millis
+    double parse_time = 0; // in millis
+    double compile_time = 0; // in millis
+    size_t peak_heap = 0; // in bytes
+
+    double Throughput() const {
+        return total_time > 0 ? (bytes * iterations) / (total_time / 1000.0) : 0;
+    }
+};
+
+std::string ReadFile(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+}
+
+BenchResult BenchMoonscript(MoonEngine::Engine& engine, const std::string& name, std::string_view code, size_t iterations,
+                            const MoonEngine::CompileOptions& options) {
+    BenchResult result;
+    result.file = name;
+    result.language = "moonscript";
+    result.mode = options.memoize ? "memo" : "plain";
+    result.bytes = code.size();
+    result.iterations = iterations;
+
+    MoonEngine::CompileInfo info;
+    for (size_t i = 0; i < iterations; i++) {
+        double start = timestamp();
+        engine.CompileInto(code, info, options);
+        result.total_time += timestamp() - start;
+
+        if (info.error) {
+            if (result.failures++ == 0) {
+                engine.FormatError(code, *info.error);
+                fprintf(stderr, "%s: %s\n", name.c_str(), info.error->display_msg.c_str());
+            }
+            continue;
+        }
+        if (info.native_parsed) result.native_parses++;
+        result.parse_time += info.parse_time;
+        result.compile_time += info.compile_time;
+        result.peak_heap = std::max(result.peak_heap, info.heap_before + info.peak_memory);
+    }
+    return result;
+}
+
+BenchResult BenchIncremental(MoonEngine::Engine& engine, const std::string& name, std::string_view code, size_t iterations,
+                             const MoonEngine::CompileOptions& options) {
+    BenchResult result;
+    result.file = name;
+    result.language = "moonscript";
+    result.mode = "incr";
+    result.bytes = code.size();
+    result.iterations = iterations;
+
+    // Edit is an empty line, so everything after it is moved
+    std::string original(code);
+    std::string edited = original;
+    size_t middle = edited.find('\n', edited.size() / 2);
+    edited.insert(middle == std::string::npos ? edited.size() : middle, "\n");
+
+    MoonEngine::CompileInfo info;
+    engine.CompileIncremental(name, original, info, options); // Warm up statement cache
+    for (size_t i = 0; i < iterations; i++) {
+        double start = timestamp();
+        std::string_view source = i % 2 == 0 ? edited : original;
+        engine.CompileIncremental(name, source, info, options);
+        result.total_time += timestamp() - start;
+
+        if (info.error) {
+            if (result.failures++ == 0) {
+                engine.FormatError(source, *info.error);
+                fprintf(stderr, "%s: %s\n", name.c_str(), info.error->display_msg.c_str());
+            }
+            continue;
+        }
+        if (info.native_parsed) result.native_parses++;
+        result.parse_time += info.parse_time;
+        result.compile_time += info.compile_time;
+        result.peak_heap = std::max(result.peak_heap, info.heap_before + info.peak_memory);
+    }
+    engine.ForgetIncremental(name);
+    return result;
+}
+
+BenchResult BenchYuescript(const std::string& name, std::string_view code, size_t iterations, bool pooled) {
+    BenchResult result;
+    result.file = name;
+    result.language = "yuescript";
+    result.mode = pooled ? "pooled" : "fresh";
+    result.bytes = code.size();
+    result.iterations = iterations;
+
+    yue::YueConfig config;
+    MoonLoader::Yuescript::DefaultConfig(config);
+    for (size_t i = 0; i < iterations; i++) {
+        double start = timestamp();
+        auto info = pooled ? MoonLoader::Yuescript::Compile(code, config)
+            : yue::YueCompiler(nullptr, MoonLoader::Yuescript::OpenLibs).compile(code, config);
+        result.total_time += timestamp() - start;
+
+        if (info.error && result.failures++ == 0)
+            fprintf(stderr, "%s: %s\n", name.c_str(), info.error->displayMessage.c_str());
+    }
+    return result;
+}
+
+void PrintText(double construction_time, const std::vector<BenchResult>& results) {
+    printf("engine construction: %.3f ms\n\n", construction_time);
+    printf("%-12s %-10s %-6s %10s %10s %12s %12s %12s %12s %8s %8s\n",
+        "file", "language", "mode", "bytes", "MB/s", "avg ms", "parse ms", "compile ms", "peak KB", "native", "fails");
+    for (const auto& r : results) {
+        double runs = r.iterations > 0 ? static_cast<double>(r.iterations) : 1;
+        printf("%-12s %-10s %-6s %10zu %10.2f %12.3f %12.3f %12.3f %12zu %8zu %8zu\n",
+            r.file.c_str(), r.language.c_str(), r.mode.c_str(), r.bytes, r.Throughput() / (1024 * 1024),
+            r.total_time / runs, r.parse_time / runs, r.compile_time / runs,
+            r.peak_heap / 1024, r.native_parses, r.failures);
+    }
+}
+
+void PrintJSON(double construction_time, const std::vector<BenchResult>& results) {
+    printf("{\n  \"engine_construction_ms\": %.3f,\n  \"results\": [\n", construction_time);
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto& r = results[i];
+        double runs = r.iterations > 0 ? static_cast<double>(r.iterations) : 1;
+        printf("    {\"file\": \"%s\", \"language\": \"%s\", \"mode\": \"%s\", \"bytes\": %zu, \"iterations\": %zu, \"failures\": %zu, \"native_parses\": %zu, "
+               "\"bytes_per_second\": %.1f, \"avg_ms\": %.4f, \"parse_ms\": %.4f, \"compile_ms\": %.4f, \"peak_heap\": %zu}%s\n",
+            r.file.c_str(), r.language.c_str(), r.mode.c_str(), r.bytes, r.iterations, r.failures, r.native_parses,
+            r.Throughput(), r.total_time / runs, r.parse_time / runs, r.compile_time / runs, r.peak_heap,
+            i + 1 < results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+int main(int argc, char** argv) {
+    bool json = false;
+    bool incremental = false;
+    size_t iterations = 20;
+    MoonEngine::CompileOptions options;
+    options.format_errors = false; // Only the first failure of every file is printed, it is formatted on demand
+    std::vector<bool> memo_modes = {false, true};
+    std::filesystem::path corpus = MOONENGINE_BENCH_CORPUS;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) json = true;
+        else if (strcmp(argv[i], "--incremental") == 0) incremental = true;
+        else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) iterations = std::stoul(argv[++i]);
+        else if (strcmp(argv[i], "--parser") == 0 && i + 1 < argc) {
+            std::string_view mode = argv[++i];
+            if (mode == "native") options.parser = MoonEngine::ParserMode::Native;
+            else if (mode == "verify") options.parser = MoonEngine::ParserMode::Verify;
+            else options.parser = MoonEngine::ParserMode::LPeg;
+        }
+        else if (strcmp(argv[i], "--memo") == 0 && i + 1 < argc) {
+            std::string_view mode = argv[++i];
+            if (mode == "on") memo_modes = {true};
+            else if (mode == "off") memo_modes = {false};
+            else memo_modes = {false, true};
+        }
+        else corpus = argv[i];
+    }
+
+    std::vector<std::filesystem::path> files;
+    for (const auto& entry : std::filesystem::directory_iterator(corpus)) {
+        auto ext = entry.path().extension();
+        if (entry.is_regular_file() && (ext == ".moon" || ext == ".yue"))
+            files.push_back(entry.path());
+    }
+    std::sort(files.begin(), files.end());
+    if (files.empty()) {
+        fprintf(stderr, "no .moon/.yue files found in %s\n", corpus.string().c_str());
+        return 1;
+    }
+
+    // Yuescript finds imported macro modules through package.path, which starts from "./"
+    for (auto& path : files)
+        path = std::filesystem::absolute(path);
+    std::filesystem::current_path(corpus);
+
+    double construction_time = timestamp();
+    MoonEngine::Engine engine;
+    construction_time = timestamp() - construction_time;
+
+    std::vector<BenchResult> results;
+    for (const auto& path : files) {
+        auto code = ReadFile(path);
+        auto name = path.filename().string();
+        if (path.extension() == ".moon") {
+            for (bool memoize : memo_modes) {
+                options.memoize = memoize;
+                results.push_back(BenchMoonscript(engine, name, code, iterations, options));
+            }
+            if (incremental)
+                results.push_back(BenchIncremental(engine, name, code, iterations, options));
+        }
+        else {
+            results.push_back(BenchYuescript(name, code, iterations, false));
+            results.push_back(BenchYuescript(name, code, iterations, true));
+        }
+    }
+
+    if (json) PrintJSON(construction_time, results);
+    else PrintText(construction_time, results);
+    return 0;
+}
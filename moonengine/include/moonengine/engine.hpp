@@ -6,6 +6,8 @@
 #include <string>
 #include <string_view>
 #include <map>
+#include <unordered_map>
+#include <vector>
 #include <memory>
 #include <utility>
 #include <optional>
@@ -17,6 +19,25 @@ namespace MoonEngine {
         void operator()(lua_State* L);
     };
 
+    // Offsets of every line start in the source,
+    // allows to convert char offset into line and column without rescanning the source
+    class LineIndex {
+        std::vector<int> m_LineStarts;
+
+    public:
+        LineIndex() = default;
+        explicit LineIndex(std::string_view str) { Build(str); }
+
+        void Build(std::string_view str);
+        int LineCount() const { return static_cast<int>(m_LineStarts.size()); }
+        bool Empty() const { return m_LineStarts.empty(); }
+
+        // Converts char offset to line number and column
+        std::pair<int, int> OffsetToLine(int pos) const;
+        // Returns given line (starting from 1) without line break
+        std::string_view Line(std::string_view str, int line) const;
+    };
+
     struct CompileInfo {
         struct Pos {
             Pos(int offset = 0, int line = 1, int col = 1) : offset(offset), line(line), col(col) {}
@@ -28,13 +49,29 @@ namespace MoonEngine {
             std::string msg;
             std::string display_msg;
             Pos pos;
+            bool formatted = true; // false if display_msg is just msg, until Engine::FormatError is called
         };
         std::string lua_code;
         std::optional<Error> error;
         std::map<int, Pos> posmap; // lua line -> moonscript pos
+        LineIndex line_index; // line index of moonscript source
         double parse_time = 0; // in millis
         double compile_time = 0; // in millis
         size_t memory_usage = 0; // in bytes
+        size_t peak_memory = 0; // highest heap growth during compilation, in bytes
+        size_t heap_before = 0; // engine heap before compilation, in bytes
+        size_t heap_after = 0; // engine heap after compilation and garbage collection, in bytes
+        bool native_parsed = false; // parse tree was built by native parser
+        size_t statements = 0; // top-level statement chunks, only for incremental compilation
+        size_t reused_statements = 0; // chunks whose parse tree was taken from previous compilation
+
+        void SetError(std::string_view msg, std::string_view display_msg = {}, Pos pos = {}) {
+            Error err;
+            err.msg = std::string(msg);
+            err.display_msg = display_msg.empty() ? err.msg : std::string(display_msg);
+            err.pos = std::move(pos);
+            error = std::move(err);
+        }
 
         static CompileInfo FromError(Error&& err) {
             CompileInfo info;
@@ -42,16 +79,51 @@ namespace MoonEngine {
             return info;
         }
         static CompileInfo FromError(std::string_view msg, std::string_view display_msg = {}, Pos pos = {}) {
-            Error err;
-            err.msg = std::string(msg);
-            err.display_msg = display_msg.empty() ? err.msg : std::string(display_msg);
-            err.pos = std::move(pos);
-            return FromError(std::move(err));
+            CompileInfo info;
+            info.SetError(msg, display_msg, pos);
+            return info;
         }
     };
 
+    // Receives generated lua code straight from the engine, without intermediate std::string
+    class CompileSink {
+    public:
+        virtual ~CompileSink() = default;
+        virtual void Write(std::string_view chunk) = 0;
+    };
+
+    // Writes lua code into given string, reusing its capacity
+    class StringSink : public CompileSink {
+        std::string& m_Output;
+
+    public:
+        explicit StringSink(std::string& output) : m_Output(output) { m_Output.clear(); }
+        void Write(std::string_view chunk) override { m_Output.append(chunk); }
+    };
+
+    enum class ParserMode {
+        LPeg, // moonscript.parse grammar
+        Native, // Native parser, falls back to LPeg grammar for sources it can't handle
+        Verify, // Native parser checked against LPeg grammar, compilation fails if trees differ
+    };
+
     struct CompileOptions {
         bool implicitly_return_root = true;
+        ParserMode parser = ParserMode::LPeg;
+        // LPeg grammar remembers rule results by position (lpeg.setmemo), so it never backtracks over the same rule twice.
+        // Results are kept until moonscript indent or do stack changes
+        bool memoize = true;
+        bool format_errors = true; // Compile errors get display_msg from moonscript format_error, otherwise it is left for Engine::FormatError
+    };
+
+    // Controls how engine heap is collected between compilations
+    struct GCPolicy {
+        size_t step_interval = 1; // Do incremental step after every N compiles, 0 disables
+        int step_size = 0; // Size of incremental step in kilobytes, 0 means a basic step
+        size_t collect_interval = 64; // Do full collection after every N compiles, 0 disables
+        size_t collect_threshold = 32 * 1024 * 1024; // Do full collection if heap is bigger than this, 0 disables
+        size_t heap_limit = 256 * 1024 * 1024; // Rebuild lua state right away if heap after full collection is still bigger, 0 disables
+        double recycle_ratio = 4.0; // Rebuild lua state when idle if heap after full collection is N times bigger than fresh one, 0 disables
     };
 
     class Engine {
@@ -65,9 +137,49 @@ namespace MoonEngine {
         int m_ParseStringRef = 0;
         int m_CompileTreeRef = 0;
         int m_CompileFormatErrorRef = 0;
+        int m_SetMemoRef = 0;
+
+        GCPolicy m_GCPolicy;
+        size_t m_BaseHeap = 0; // heap of fresh engine
+        size_t m_Compiles = 0;
+        bool m_NeedsRecycle = false;
+
+        // Posmap nodes from previous compilations, reused by CompileInto
+        std::vector<std::map<int, CompileInfo::Pos>::node_type> m_SparePosNodes;
+
+        // Parse trees of top-level statements from the last incremental compilation of a source
+        struct IncrementalUnit {
+            std::unordered_multimap<std::string, int> statements; // statement source -> registry ref of its parse tree
+            size_t last_use = 0;
+        };
+        std::unordered_map<std::string, IncrementalUnit> m_IncrementalUnits;
+        size_t m_IncrementalClock = 0;
+        std::vector<std::string_view> m_StatementChunks;
+
+        // optionsIndex is stack index of prebuilt moonscript options table, 0 builds a new one
+        void CompileImpl(std::string_view moonCode, CompileInfo& info, CompileSink* sink, const CompileOptions& options,
+                         int optionsIndex = 0, IncrementalUnit* unit = nullptr);
+        bool ParseImpl(std::string_view moonCode, CompileInfo& info, const CompileOptions& options);
+        bool ParseIncremental(std::string_view moonCode, CompileInfo& info, const CompileOptions& options, IncrementalUnit& unit);
+        IncrementalUnit& GetIncrementalUnit(std::string_view name);
+        void FreeIncrementalUnit(IncrementalUnit& unit);
+        bool ParseLPeg(std::string_view moonCode, CompileInfo& info, bool memoize);
+        void ResetInfo(CompileInfo& info);
+        void InsertPos(CompileInfo& info, int line, CompileInfo::Pos pos);
+        void ApplyGCPolicy(size_t compiles = 1);
 
     public:
-        Engine();
+        explicit Engine(const GCPolicy& policy = {});
+
+        const GCPolicy& GetGCPolicy() const { return m_GCPolicy; }
+        void SetGCPolicy(const GCPolicy& policy) { m_GCPolicy = policy; }
+
+        // Current size of lua heap in bytes
+        size_t HeapSize() const;
+        // Lua state is fragmented enough, and should be rebuilt when engine is idle
+        bool NeedsRecycle() const { return m_NeedsRecycle; }
+        // Replaces lua state with a fresh one, returns false if new state could not be created
+        bool Recycle();
 
         void RunLua(const char* luaCode);
         std::string CompileString(const char* moonCode, size_t len, CompiledLines* lineTable = nullptr);
@@ -82,6 +194,31 @@ namespace MoonEngine {
 
         CompileInfo CompileString2(std::string_view moonCode, const CompileOptions& options = {});
 
+        // Same as CompileString2, but reuses buffers and containers of given info between calls
+        void CompileInto(std::string_view moonCode, CompileInfo& info, const CompileOptions& options = {});
+        // Generated lua code is written into the sink instead of info.lua_code
+        void CompileInto(std::string_view moonCode, CompileInfo& info, CompileSink& sink, const CompileOptions& options = {});
+
+        // Compiles count sources into results[0..count), GC pause and options setup are shared by the whole batch
+        void CompileBatch(const std::string_view* moonCodes, size_t count, CompileInfo* results, const CompileOptions& options = {});
+        std::vector<CompileInfo> CompileBatch(const std::vector<std::string_view>& moonCodes, const CompileOptions& options = {}) {
+            std::vector<CompileInfo> results(moonCodes.size());
+            CompileBatch(moonCodes.data(), moonCodes.size(), results.data(), options);
+            return results;
+        }
+
+        // Builds display_msg of compile error which was skipped by CompileOptions::format_errors,
+        // moonCode must be the same source which failed to compile
+        void FormatError(std::string_view moonCode, CompileInfo::Error& error);
+
+        // Same as CompileInto, but remembers parse trees of top-level statements under given unit name (e.g. file path),
+        // so the next compilation of that unit only parses statements which were changed.
+        // Code generation still runs for the whole source, because moonscript scoping depends on previous statements.
+        void CompileIncremental(std::string_view unit, std::string_view moonCode, CompileInfo& info, const CompileOptions& options = {});
+        void CompileIncremental(std::string_view unit, std::string_view moonCode, CompileInfo& info, CompileSink& sink, const CompileOptions& options = {});
+        // Drops remembered parse trees of given unit
+        void ForgetIncremental(std::string_view unit);
+
         // Converts char offset to line number and column
         static std::pair<int, int> OffsetToLine(std::string_view str, int pos);
         inline static CompileInfo::Pos OffsetToPos(std::string_view str, int pos) {
@@ -0,0 +1,80 @@
+#ifndef MOONENGINE_POOL_HPP
+#define MOONENGINE_POOL_HPP
+
+#pragma once
+
+#include "engine.hpp"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include <type_traits>
+
+namespace MoonEngine {
+    // Set of pre-warmed engines, each of them is owned by its own worker thread.
+    // Engine is never touched outside of its thread, so different sources
+    // can be compiled in parallel.
+    class EnginePool {
+        GCPolicy m_GCPolicy;
+        std::vector<std::thread> m_Workers;
+        std::deque<std::function<void(Engine&)>> m_Tasks;
+        std::vector<std::deque<std::function<void(Engine&)>>> m_EngineTasks; // Tasks for specific engine
+        std::mutex m_Lock;
+        std::condition_variable m_Condition;
+        bool m_Stopping = false;
+
+        void WorkerMain(size_t index, std::promise<void> ready);
+        void Post(std::function<void(Engine&)> task);
+        void PostTo(size_t index, std::function<void(Engine&)> task);
+        void Stop();
+
+    public:
+        // Zero size means one engine per hardware thread
+        explicit EnginePool(size_t size = 0, const GCPolicy& policy = {});
+        ~EnginePool();
+
+        EnginePool(const EnginePool&) = delete;
+        EnginePool& operator=(const EnginePool&) = delete;
+
+        size_t Size() const { return m_Workers.size(); }
+
+        // Runs given function with the first free engine on its worker thread
+        template<class Func>
+        auto Run(Func&& func) -> std::future<std::invoke_result_t<Func, Engine&>> {
+            using Result = std::invoke_result_t<Func, Engine&>;
+            auto task = std::make_shared<std::packaged_task<Result(Engine&)>>(std::forward<Func>(func));
+            auto result = task->get_future();
+            Post([task](Engine& engine) { (*task)(engine); });
+            return result;
+        }
+
+        // Runs given function on the engine chosen by key (any number, e.g. hash of file path),
+        // same key always gets the same engine, so it can reuse state kept between compilations
+        template<class Func>
+        auto RunOn(size_t key, Func&& func) -> std::future<std::invoke_result_t<Func, Engine&>> {
+            using Result = std::invoke_result_t<Func, Engine&>;
+            auto task = std::make_shared<std::packaged_task<Result(Engine&)>>(std::forward<Func>(func));
+            auto result = task->get_future();
+            PostTo(key % Size(), [task](Engine& engine) { (*task)(engine); });
+            return result;
+        }
+
+        std::future<CompileInfo> Submit(std::string moonCode, CompileOptions options = {});
+
+        // Blocks until compilation is finished, moonCode must be alive until then
+        CompileInfo Compile(std::string_view moonCode, const CompileOptions& options = {});
+
+        // Splits sources between engines and compiles them as batches in parallel,
+        // results are in the same order as sources. Blocks until all of them are finished.
+        std::vector<CompileInfo> CompileBatch(const std::vector<std::string_view>& moonCodes, const CompileOptions& options = {});
+    };
+}
+
+#endif // MOONENGINE_POOL_HPP
@@ -0,0 +1,222 @@
+#include "allocator.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+using namespace MoonEngine;
+
+namespace {
+    // Slabs are aligned to their size, so slab of a block is found by masking its address
+    void* AllocSlabMemory() {
+#if defined(_WIN32)
+        return _aligned_malloc(Allocator::SLAB_SIZE, Allocator::SLAB_SIZE);
+#else
+        void* ptr = nullptr;
+        return posix_memalign(&ptr, Allocator::SLAB_SIZE, Allocator::SLAB_SIZE) == 0 ? ptr : nullptr;
+#endif
+    }
+
+    void FreeSlabMemory(void* ptr) {
+#if defined(_WIN32)
+        _aligned_free(ptr);
+#else
+        std::free(ptr);
+#endif
+    }
+
+    inline size_t SizeClass(size_t size) {
+        return (size - 1) / Allocator::GRANULARITY;
+    }
+
+    inline size_t BlockSize(size_t size_class) {
+        return (size_class + 1) * Allocator::GRANULARITY;
+    }
+}
+
+Allocator::~Allocator() {
+    // lua_close frees every block, so all slabs should be empty by now
+    for (auto& slab : m_Partial) {
+        while (slab) {
+            Slab* next = slab->next;
+            FreeSlabMemory(slab);
+            slab = next;
+        }
+    }
+    Trim(0);
+
+    while (m_Stray) {
+        auto next = m_Stray->next;
+        std::free(m_Stray);
+        m_Stray = next;
+    }
+}
+
+void* Allocator::Alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+    auto self = static_cast<Allocator*>(ud);
+    size_t old_size = ptr ? osize : 0; // Without ptr osize is a type of lua object
+    bool old_small = ptr && osize <= MAX_SMALL && !(self->m_Stray && self->IsStray(ptr));
+    bool new_small = nsize <= MAX_SMALL;
+
+    void* result = nullptr;
+    if (nsize == 0) {
+        if (ptr) {
+            if (old_small) self->FreeSmall(ptr);
+            else std::free(ptr);
+        }
+    } else if (!ptr) {
+        result = new_small ? self->AllocSmall(SizeClass(nsize)) : std::malloc(nsize);
+        if (!result) return nullptr;
+    } else if (!old_small && !new_small) {
+        result = std::realloc(ptr, nsize);
+        if (!result) {
+            if (nsize > osize) return nullptr;
+            // Lua 5.2 assumes shrinking never fails, it owns nsize bytes of the old block from now on
+            self->Account(old_size, nsize);
+            return ptr;
+        }
+    } else if (old_small && new_small && SizeClass(osize) == SizeClass(nsize)) {
+        result = ptr;
+    } else {
+        // Block moves between slab and malloc, or between size classes
+        result = new_small ? self->AllocSmall(SizeClass(nsize)) : std::malloc(nsize);
+        if (!result) {
+            // Failed growth leaves the old block to lua, but shrinking must never fail,
+            // so the old block is kept and lua owns nsize bytes of it
+            if (nsize > osize) return nullptr;
+            // Lua will pass small size for it from now on, but it still has to go back to free
+            if (!old_small && new_small && !self->IsStray(ptr) && !self->AddStray(ptr)) return nullptr;
+            self->Account(old_size, nsize);
+            return ptr;
+        }
+        std::memcpy(result, ptr, std::min(osize, nsize));
+        if (old_small) self->FreeSmall(ptr);
+        else std::free(ptr);
+    }
+
+    // Stray block was freed, or lua knows its real size now
+    if (ptr && !old_small && osize <= MAX_SMALL)
+        self->ForgetStray(ptr);
+
+    self->Account(old_size, nsize);
+    return result;
+}
+
+void Allocator::Account(size_t old_size, size_t new_size) {
+    m_Used = m_Used - old_size + new_size;
+    m_Peak = std::max(m_Peak, m_Used);
+}
+
+void* Allocator::AllocSmall(size_t size_class) {
+    Slab* slab = m_Partial[size_class];
+    if (!slab) {
+        slab = NewSlab(size_class);
+        if (!slab) return nullptr;
+        Link(slab);
+    }
+
+    void* block;
+    if (slab->free) {
+        block = slab->free;
+        slab->free = slab->free->next;
+    } else {
+        block = slab->bump;
+        slab->bump += BlockSize(size_class);
+    }
+
+    // Full slabs are not tracked, their blocks will bring them back when freed
+    if (++slab->used == slab->capacity) Unlink(slab);
+    return block;
+}
+
+void Allocator::FreeSmall(void* ptr) {
+    auto slab = reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(ptr) & ~static_cast<uintptr_t>(SLAB_SIZE - 1));
+    auto block = static_cast<FreeBlock*>(ptr);
+    block->next = slab->free;
+    slab->free = block;
+
+    if (slab->used-- == slab->capacity) Link(slab);
+    if (slab->used == 0) {
+        Unlink(slab);
+        slab->next = m_Empty;
+        m_Empty = slab;
+        m_EmptyCount++;
+    }
+}
+
+Allocator::Slab* Allocator::NewSlab(size_t size_class) {
+    Slab* slab = m_Empty;
+    if (slab) {
+        m_Empty = slab->next;
+        m_EmptyCount--;
+    } else {
+        slab = static_cast<Slab*>(AllocSlabMemory());
+        if (!slab) return nullptr;
+        m_SlabCount++;
+    }
+
+    constexpr size_t header = (sizeof(Slab) + GRANULARITY - 1) / GRANULARITY * GRANULARITY;
+    slab->prev = nullptr;
+    slab->next = nullptr;
+    slab->free = nullptr;
+    slab->bump = reinterpret_cast<char*>(slab) + header;
+    slab->used = 0;
+    slab->capacity = static_cast<uint32_t>((SLAB_SIZE - header) / BlockSize(size_class));
+    slab->size_class = static_cast<uint32_t>(size_class);
+    return slab;
+}
+
+void Allocator::Link(Slab* slab) {
+    Slab*& head = m_Partial[slab->size_class];
+    slab->prev = nullptr;
+    slab->next = head;
+    if (head) head->prev = slab;
+    head = slab;
+}
+
+void Allocator::Unlink(Slab* slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else m_Partial[slab->size_class] = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->prev = slab->next = nullptr;
+}
+
+bool Allocator::AddStray(void* block) {
+    auto stray = static_cast<StrayBlock*>(std::malloc(sizeof(StrayBlock)));
+    if (!stray) return false;
+    stray->block = block;
+    stray->next = m_Stray;
+    m_Stray = stray;
+    return true;
+}
+
+bool Allocator::IsStray(void* block) const {
+    for (auto stray = m_Stray; stray; stray = stray->next)
+        if (stray->block == block) return true;
+    return false;
+}
+
+void Allocator::ForgetStray(void* block) {
+    for (auto link = &m_Stray; *link; link = &(*link)->next) {
+        if ((*link)->block == block) {
+            auto stray = *link;
+            *link = stray->next;
+            std::free(stray);
+            return;
+        }
+    }
+}
+
+void Allocator::Trim(size_t keep) {
+    while (m_EmptyCount > keep) {
+        Slab* slab = m_Empty;
+        m_Empty = slab->next;
+        m_EmptyCount--;
+        m_SlabCount--;
+        FreeSlabMemory(slab);
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef MOONENGINE_ALLOCATOR_HPP
+#define MOONENGINE_ALLOCATOR_HPP
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace MoonEngine {
+    // lua_Alloc of engine state. Small blocks (tables, strings, closures of AST)
+    // are carved from size-class slabs, so short-lived garbage of every compilation
+    // is reused instead of fragmenting the process heap. Big blocks go to malloc.
+    // Not thread-safe, every engine owns its allocator.
+    class Allocator {
+    public:
+        static constexpr size_t SLAB_SIZE = 64 * 1024;
+        static constexpr size_t GRANULARITY = 16;
+        static constexpr size_t MAX_SMALL = 512;
+        static constexpr size_t CLASSES = MAX_SMALL / GRANULARITY;
+
+    private:
+        struct FreeBlock {
+            FreeBlock* next;
+        };
+
+        // Lives at the start of every slab, slabs are aligned to SLAB_SIZE
+        struct Slab {
+            Slab* prev;
+            Slab* next;
+            FreeBlock* free; // Freed blocks
+            char* bump; // Never used space starts here
+            uint32_t used;
+            uint32_t capacity;
+            uint32_t size_class;
+        };
+
+        // Big block which lua shrank to a small size while no slab block could be allocated.
+        // Shrinking must not fail, so lua keeps the malloc block, but believes it is small
+        struct StrayBlock {
+            void* block;
+            StrayBlock* next;
+        };
+
+        Slab* m_Partial[CLASSES] = {}; // Slabs with free space, by size class
+        Slab* m_Empty = nullptr; // Empty slabs kept for reuse, linked through next
+        size_t m_EmptyCount = 0;
+        size_t m_SlabCount = 0;
+        size_t m_Used = 0; // Bytes requested by lua
+        size_t m_Peak = 0;
+        StrayBlock* m_Stray = nullptr; // Almost always empty, only out of memory adds there
+
+        void* AllocSmall(size_t size_class);
+        void FreeSmall(void* ptr);
+        Slab* NewSlab(size_t size_class);
+        void Unlink(Slab* slab);
+        void Link(Slab* slab);
+        bool AddStray(void* block);
+        bool IsStray(void* block) const;
+        void ForgetStray(void* block);
+        // Lua owns new_size bytes of a block instead of old_size
+        void Account(size_t old_size, size_t new_size);
+
+    public:
+        Allocator() = default;
+        ~Allocator();
+
+        Allocator(const Allocator&) = delete;
+        Allocator& operator=(const Allocator&) = delete;
+
+        // lua_Alloc compatible function, ud is Allocator
+        static void* Alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
+        size_t Used() const { return m_Used; }
+        // Highest Used() since last ResetPeak
+        size_t Peak() const { return m_Peak; }
+        void ResetPeak() { m_Peak = m_Used; }
+        // Memory taken from the system, including free blocks of slabs (big blocks aren't counted)
+        size_t Reserved() const { return m_SlabCount * SLAB_SIZE; }
+
+        // Gives empty slabs back to the system, except given amount of them, which is kept for next compilations
+        void Trim(size_t keep = 0);
+    };
+}
+
+#endif // MOONENGINE_ALLOCATOR_HPP
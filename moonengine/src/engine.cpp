@@ -4,12 +4,21 @@
 #include <string>
 #include <algorithm>
 #include <chrono>
+#include <cstring>
 
 #include "lua.hpp"
+#include "parser.hpp"
+#include "incremental.hpp"
+#include "allocator.hpp"
 #include "moonscript/entry.hpp"
 
 using namespace MoonEngine;
 
+// Incrementally compiled sources which keep their parse trees, least recently used are dropped
+constexpr size_t MAX_INCREMENTAL_UNITS = 16;
+// Empty allocator slabs kept between compilations, so next compilation doesn't have to ask system for memory
+constexpr size_t KEEP_EMPTY_SLABS = 16;
+
 inline double timestamp() {
     using clock = std::chrono::steady_clock;
     using dur = std::chrono::duration<double, std::milli>;
@@ -27,6 +36,55 @@ inline size_t lua_gc_count(lua_State* L) {
     return lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
 }
 
+// Wraps upvalue 1, calling lpeg.flushmemo (upvalue 2) first
+inline int flush_memo_and_call(lua_State* L) {
+    lua_pushvalue(L, lua_upvalueindex(2));
+    lua_call(L, 0, 0);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+    return lua_gettop(L);
+}
+
+// All state of moonscript.parse grammar (indent and do stacks) is kept in moonscript.data.Stack objects,
+// so their push and pop tell lpeg about state changes. Other match-time captures of the grammar only read it,
+// which lets tracked packrat mode keep results across the indent check done on every line
+// Expects lpeg table on top of the stack
+inline void track_grammar_state(lua_State* L) {
+    lua_getfield(L, -1, "flushmemo");
+    if (!lua_isfunction(L, -1)) throw std::runtime_error("lpeg.flushmemo not found");
+
+    lua_getglobal(L, "require");
+    lua_pushstring(L, "moonscript.data");
+    if (lua_pcall(L, 1, 1, 0) != 0)
+        throw std::runtime_error(lua_tostring(L, -1));
+    lua_getfield(L, -1, "Stack");
+    if (!lua_istable(L, -1)) throw std::runtime_error("moonscript.data.Stack not found");
+    lua_getfield(L, -1, "__base");
+    if (!lua_istable(L, -1)) throw std::runtime_error("moonscript.data.Stack has no __base");
+
+    for (const char* method : {"push", "pop"}) {
+        lua_getfield(L, -1, method);
+        if (!lua_isfunction(L, -1)) throw std::runtime_error(std::string("moonscript.data.Stack has no ") + method);
+        lua_pushvalue(L, -5); // lpeg.flushmemo
+        lua_pushcclosure(L, flush_memo_and_call, 2);
+        lua_setfield(L, -2, method);
+    }
+    lua_pop(L, 4); // Pop __base, Stack, moonscript.data table and lpeg.flushmemo
+}
+
+inline Allocator* get_allocator(lua_State* L) {
+    void* ud = nullptr;
+    lua_getallocf(L, &ud);
+    return static_cast<Allocator*>(ud);
+}
+
+// Same as panic of luaL_newstate
+inline int panic(lua_State* L) {
+    fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+    return 0;
+}
+
 inline int print(lua_State* L) {
     int top = lua_gettop(L);
     for (int i = 0; i < top; i++) {
@@ -68,11 +126,22 @@ inline void stackDump(lua_State* L) {
     printf("--------------- Stack Dump Finished ---------------\n");
 }
 
-void LuaStateDeleter::operator()(lua_State* L) { lua_close(L); }
+// Allocator must outlive its state, so it is owned by the state itself
+void LuaStateDeleter::operator()(lua_State* L) {
+    auto allocator = get_allocator(L);
+    lua_close(L);
+    delete allocator;
+}
 
-Engine::Engine() {
-    m_State = std::unique_ptr<lua_State, LuaStateDeleter>(luaL_newstate(),
-                                                          LuaStateDeleter());
+Engine::Engine(const GCPolicy& policy) : m_GCPolicy(policy) {
+    auto allocator = new Allocator();
+    lua_State* state = lua_newstate(Allocator::Alloc, allocator);
+    if (!state) {
+        delete allocator;
+        throw std::runtime_error("failed to create lua state");
+    }
+    lua_atpanic(state, panic);
+    m_State = std::unique_ptr<lua_State, LuaStateDeleter>(state, LuaStateDeleter());
     auto L = m_State.get();
 
     luaL_openlibs(L);  // Initialize Lua standard libraries
@@ -102,6 +171,16 @@ Engine::Engine() {
     m_ParseStringRef = luaL_ref(L, LUA_REGISTRYINDEX);
     lua_pop(L, 1);  // Pop moonscript.parse table
 
+    lua_getglobal(L, "require");
+    lua_pushstring(L, "lpeg");
+    if (lua_pcall(L, 1, 1, 0) != 0)
+        throw std::runtime_error(lua_tostring(L, -1));
+
+    lua_getfield(L, -1, "setmemo");
+    m_SetMemoRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    track_grammar_state(L);
+    lua_pop(L, 1);  // Pop lpeg table
+
     lua_getglobal(L, "require");
     lua_pushstring(L, "moonscript.compile");
     if (lua_pcall(L, 1, 1, 0) != 0)
@@ -117,19 +196,91 @@ Engine::Engine() {
     if (m_ParseStringRef <= 0) throw std::runtime_error("parse.string not found");
     if (m_CompileTreeRef <= 0) throw std::runtime_error("compile.tree not found");
     if (m_CompileFormatErrorRef <= 0) throw std::runtime_error("compile.format_error not found");
+    if (m_SetMemoRef <= 0) throw std::runtime_error("lpeg.setmemo not found");
+
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    m_BaseHeap = HeapSize();
 }
 
-std::pair<int, int> Engine::OffsetToLine(std::string_view str, int pos) {
-    int line_pos = 0;
-    int line = 1;
-    int len = std::clamp(pos, 0, (int)str.length());
-    for (int i = 0; i < len; i++) {
-        if (str[i] == '\n') {
-            line++;
-            line_pos = i + 1;
+size_t Engine::HeapSize() const {
+    return lua_gc_count(m_State.get());
+}
+
+bool Engine::Recycle() {
+    try {
+        Engine fresh(m_GCPolicy);
+        *this = std::move(fresh);
+        return true;
+    } catch (const std::exception&) {
+        // Keep using our current state, it is still valid
+        m_NeedsRecycle = false;
+        return false;
+    }
+}
+
+// Interval is hit if any compile count in (before, after] is divisible by it
+inline bool crossed_interval(size_t before, size_t after, size_t interval) {
+    return interval > 0 && after / interval != before / interval;
+}
+
+void Engine::ApplyGCPolicy(size_t compiles) {
+    auto L = m_State.get();
+    size_t before = m_Compiles;
+    m_Compiles += compiles;
+
+    bool collect = (m_GCPolicy.collect_threshold > 0 && HeapSize() > m_GCPolicy.collect_threshold)
+        || crossed_interval(before, m_Compiles, m_GCPolicy.collect_interval);
+    if (!collect) {
+        if (crossed_interval(before, m_Compiles, m_GCPolicy.step_interval)) {
+            lua_gc(L, LUA_GCSTEP, m_GCPolicy.step_size);
+            get_allocator(L)->Trim(KEEP_EMPTY_SLABS);
         }
+        return;
+    }
+
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    // Garbage of previous compilations is gone, slabs which held only it can be released in bulk
+    get_allocator(L)->Trim(KEEP_EMPTY_SLABS);
+    size_t heap = HeapSize();
+    if (m_GCPolicy.heap_limit > 0 && heap > m_GCPolicy.heap_limit) {
+        // Hard limit, we can't wait until engine is idle
+        Recycle();
+    } else if (m_GCPolicy.recycle_ratio > 0 && heap > m_BaseHeap * m_GCPolicy.recycle_ratio) {
+        m_NeedsRecycle = true;
     }
-    return {line, len - line_pos + 1};
+}
+
+void LineIndex::Build(std::string_view str) {
+    m_LineStarts.clear();
+    m_LineStarts.push_back(0);
+    const char* begin = str.data();
+    const char* end = begin + str.size();
+    for (const char* ptr = begin; (ptr = static_cast<const char*>(std::memchr(ptr, '\n', end - ptr))) != nullptr; ptr++)
+        m_LineStarts.push_back(static_cast<int>(ptr - begin) + 1);
+}
+
+std::pair<int, int> LineIndex::OffsetToLine(int pos) const {
+    if (m_LineStarts.empty()) return {1, 1};
+
+    int len = std::max(pos, 0);
+    // Last line start which is not after our offset
+    auto it = std::upper_bound(m_LineStarts.begin(), m_LineStarts.end(), len);
+    int line = static_cast<int>(it - m_LineStarts.begin());
+    return {line, len - m_LineStarts[line - 1] + 1};
+}
+
+std::string_view LineIndex::Line(std::string_view str, int line) const {
+    if (line < 1 || line > LineCount()) return {};
+
+    size_t start = m_LineStarts[line - 1];
+    size_t end = line < LineCount() ? m_LineStarts[line] - 1 : str.size();
+    if (start > str.size()) return {};
+    return str.substr(start, std::min(end, str.size()) - start);
+}
+
+std::pair<int, int> Engine::OffsetToLine(std::string_view str, int pos) {
+    int len = std::clamp(pos, 0, (int)str.length());
+    return LineIndex(str.substr(0, len)).OffsetToLine(len);
 }
 
 void Engine::RunLua(const char* luaCode) {
@@ -194,59 +345,324 @@ std::string Engine::CompileString(const char* moonCode, size_t len,
 }
 
 CompileInfo Engine::CompileString2(std::string_view moonCode, const CompileOptions& options) {
-    auto L = m_State.get();
     CompileInfo info;
+    CompileInto(moonCode, info, options);
+    return info;
+}
 
-    // Preparing
-    lua_gc(L, LUA_GCSTOP, 0); // We don't need GC to slowdown transpilation
-    std::shared_ptr<void> _(nullptr, [L](...) { lua_gc(L, LUA_GCRESTART, 0); });
-    info.memory_usage = lua_gc_count(L);
+void Engine::CompileInto(std::string_view moonCode, CompileInfo& info, const CompileOptions& options) {
+    size_t heap_before = HeapSize();
+    CompileImpl(moonCode, info, nullptr, options);
+    ApplyGCPolicy();
+    info.heap_before = heap_before;
+    info.heap_after = HeapSize();
+}
 
-    // Parsing
-    info.parse_time = timestamp();
+void Engine::CompileInto(std::string_view moonCode, CompileInfo& info, CompileSink& sink, const CompileOptions& options) {
+    size_t heap_before = HeapSize();
+    CompileImpl(moonCode, info, &sink, options);
+    ApplyGCPolicy();
+    info.heap_before = heap_before;
+    info.heap_after = HeapSize();
+}
+
+void Engine::CompileBatch(const std::string_view* moonCodes, size_t count, CompileInfo* results, const CompileOptions& options) {
+    if (count == 0) return;
+
+    auto L = m_State.get();
+    {
+        lua_gc(L, LUA_GCSTOP, 0);
+        std::shared_ptr<void> _(nullptr, [L](...) { lua_gc(L, LUA_GCRESTART, 0); });
+
+        push_moon_options(L, options);
+        int optionsIndex = lua_gettop(L);
+        for (size_t i = 0; i < count; i++) {
+            // GC is paused for the whole batch, so don't let big batches grow the heap without limits
+            if (i > 0 && m_GCPolicy.collect_threshold > 0 && HeapSize() > m_GCPolicy.collect_threshold)
+                lua_gc(L, LUA_GCCOLLECT, 0);
+
+            size_t heap_before = HeapSize();
+            CompileImpl(moonCodes[i], results[i], nullptr, options, optionsIndex);
+            results[i].heap_before = heap_before;
+        }
+        lua_pop(L, 1); // Pop options
+    }
+
+    ApplyGCPolicy(count);
+    size_t heap_after = HeapSize();
+    for (size_t i = 0; i < count; i++)
+        results[i].heap_after = heap_after;
+}
+
+void Engine::CompileIncremental(std::string_view unit, std::string_view moonCode, CompileInfo& info, const CompileOptions& options) {
+    size_t heap_before = HeapSize();
+    CompileImpl(moonCode, info, nullptr, options, 0, &GetIncrementalUnit(unit));
+    ApplyGCPolicy();
+    info.heap_before = heap_before;
+    info.heap_after = HeapSize();
+}
+
+void Engine::CompileIncremental(std::string_view unit, std::string_view moonCode, CompileInfo& info, CompileSink& sink, const CompileOptions& options) {
+    size_t heap_before = HeapSize();
+    CompileImpl(moonCode, info, &sink, options, 0, &GetIncrementalUnit(unit));
+    ApplyGCPolicy();
+    info.heap_before = heap_before;
+    info.heap_after = HeapSize();
+}
+
+void Engine::ForgetIncremental(std::string_view unit) {
+    auto it = m_IncrementalUnits.find(std::string(unit));
+    if (it == m_IncrementalUnits.end()) return;
+    FreeIncrementalUnit(it->second);
+    m_IncrementalUnits.erase(it);
+}
+
+Engine::IncrementalUnit& Engine::GetIncrementalUnit(std::string_view name) {
+    auto [it, inserted] = m_IncrementalUnits.try_emplace(std::string(name));
+    it->second.last_use = ++m_IncrementalClock;
+    if (inserted && m_IncrementalUnits.size() > MAX_INCREMENTAL_UNITS) {
+        auto oldest = std::min_element(m_IncrementalUnits.begin(), m_IncrementalUnits.end(), [](const auto& a, const auto& b) {
+            return a.second.last_use < b.second.last_use;
+        });
+        FreeIncrementalUnit(oldest->second);
+        m_IncrementalUnits.erase(oldest); // Never the one we just created, it is the newest
+    }
+    return it->second;
+}
+
+void Engine::FreeIncrementalUnit(IncrementalUnit& unit) {
+    auto L = m_State.get();
+    for (const auto& [source, ref] : unit.statements)
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    unit.statements.clear();
+}
+
+void Engine::ResetInfo(CompileInfo& info) {
+    info.error.reset();
+    info.lua_code.clear(); // Keeps its capacity
+    info.parse_time = 0;
+    info.compile_time = 0;
+    info.memory_usage = 0;
+    info.native_parsed = false;
+    info.peak_memory = 0;
+    info.statements = 0;
+    info.reused_statements = 0;
+
+    // Keep posmap nodes, so they can be reused without allocation
+    while (!info.posmap.empty())
+        m_SparePosNodes.push_back(info.posmap.extract(info.posmap.begin()));
+}
+
+void Engine::InsertPos(CompileInfo& info, int line, CompileInfo::Pos pos) {
+    if (m_SparePosNodes.empty()) {
+        info.posmap.insert_or_assign(line, pos);
+        return;
+    }
+
+    auto node = std::move(m_SparePosNodes.back());
+    m_SparePosNodes.pop_back();
+    node.key() = line;
+    node.mapped() = pos;
+    auto result = info.posmap.insert(std::move(node));
+    if (!result.inserted) {
+        result.position->second = pos;
+        m_SparePosNodes.push_back(std::move(result.node));
+    }
+}
+
+inline void set_lpeg_memo(lua_State* L, int ref, bool enabled) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    lua_pushboolean(L, enabled);
+    lua_pushboolean(L, enabled); // tracked mode, see track_grammar_state
+    lua_call(L, 2, 0);
+}
+
+bool Engine::ParseLPeg(std::string_view moonCode, CompileInfo& info, bool memoize) {
+    auto L = m_State.get();
+    // Memoization is only wanted for moonscript grammar, not for other lpeg users in the state
+    if (memoize) set_lpeg_memo(L, m_SetMemoRef, true);
     lua_rawgeti(L, LUA_REGISTRYINDEX, m_ParseStringRef);
     lua_pushlstring(L, moonCode.data(), moonCode.size());
-    if (lua_pcall(L, 1, 2, 0) != 0) {
+    int status = lua_pcall(L, 1, 2, 0);
+    if (memoize) set_lpeg_memo(L, m_SetMemoRef, false);
+    if (status != 0) {
         std::string err = lua_tostring(L, -1); lua_pop(L, 1);
-        return CompileInfo::FromError(err, "failed to run parser.string: " + err);
+        info.SetError(err, "failed to run parser.string: " + err);
+        return false;
     }
     if (lua_isnil(L, -2)) {
+        // Remembered rules skip indent checks, which record the last checked position for the error message,
+        // so parse again without memoization to report the same line
+        if (memoize) {
+            lua_pop(L, 2);
+            return ParseLPeg(moonCode, info, false);
+        }
         std::string err = lua_tostring(L, -1); lua_pop(L, 2);
-        return CompileInfo::FromError(err);
+        info.SetError(err);
+        return false;
     }
     lua_pop(L, 1); // Pop error
+    return true;
+}
+
+// Leaves parse tree on the stack
+bool Engine::ParseImpl(std::string_view moonCode, CompileInfo& info, const CompileOptions& options) {
+    auto L = m_State.get();
+    if (options.parser == ParserMode::LPeg || !NativeParse(L, moonCode))
+        return ParseLPeg(moonCode, info, options.memoize);
+
+    info.native_parsed = true;
+    if (options.parser != ParserMode::Verify) return true;
+
+    // LPeg grammar is the reference, both trees must be the same
+    if (!ParseLPeg(moonCode, info, options.memoize)) {
+        lua_pop(L, 1);
+        info.SetError("native parser accepted invalid code: " + info.error->msg);
+        return false;
+    }
+    std::string path;
+    bool same = CompareTrees(L, -2, -1, path);
+    lua_pop(L, 1);
+    if (!same) {
+        lua_pop(L, 1);
+        info.SetError("native parser tree mismatch at " + path);
+        return false;
+    }
+    return true;
+}
+
+void Engine::FormatError(std::string_view moonCode, CompileInfo::Error& error) {
+    if (error.formatted) return;
+
+    auto L = m_State.get();
+    lua_rawgeti(L, LUA_REGISTRYINDEX, m_CompileFormatErrorRef);
+    lua_pushlstring(L, error.msg.data(), error.msg.size());
+    if (error.pos.offset > 0) lua_pushinteger(L, error.pos.offset);
+    else lua_pushnil(L); // Lua offsets start from 1, so there was no position
+    lua_pushlstring(L, moonCode.data(), moonCode.size());
+    if (lua_pcall(L, 3, 1, 0) == 0 && lua_isstring(L, -1)) error.display_msg = lua_tostring(L, -1);
+    lua_pop(L, 1);
+    error.formatted = true;
+}
+
+// Leaves parse tree on the stack, built from cached trees of unchanged top-level statements
+bool Engine::ParseIncremental(std::string_view moonCode, CompileInfo& info, const CompileOptions& options, IncrementalUnit& unit) {
+    auto L = m_State.get();
+    SplitStatements(moonCode, m_StatementChunks);
+
+    decltype(unit.statements) statements;
+    lua_createtable(L, static_cast<int>(m_StatementChunks.size()), 0);
+    int tree = lua_gettop(L);
+    int index = 1;
+    bool failed = false;
+    for (auto chunk : m_StatementChunks) {
+        std::string source(chunk);
+        int ref;
+        if (auto node = unit.statements.extract(source)) {
+            ref = node.mapped();
+            statements.insert(std::move(node));
+            info.reused_statements++;
+        } else {
+            // Cached trees keep positions relative to their chunk, so they can be reused wherever chunk moves
+            if (!ParseImpl(chunk, info, options)) {
+                failed = true;
+                break;
+            }
+            ref = luaL_ref(L, LUA_REGISTRYINDEX);
+            statements.emplace(std::move(source), ref);
+        }
+
+        int offset = static_cast<int>(chunk.data() - moonCode.data());
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+        int count = static_cast<int>(lua_rawlen(L, -1));
+        for (int i = 1; i <= count && !failed; i++) {
+            lua_rawgeti(L, -1, i);
+            if (CopyTree(L, offset)) lua_rawseti(L, tree, index++);
+            else failed = true;
+        }
+        lua_pop(L, 1);
+        if (failed) break;
+    }
+
+    // Statements which are not present anymore are dropped
+    FreeIncrementalUnit(unit);
+    unit.statements = std::move(statements);
+    info.statements = m_StatementChunks.size();
+    if (!failed) return true;
+
+    // Splitting might have cut a statement in the middle, whole source is parsed to get the same result (or error) as usual
+    FreeIncrementalUnit(unit);
+    lua_settop(L, tree - 1);
+    info.error.reset();
+    info.native_parsed = false;
+    info.reused_statements = 0;
+    return ParseImpl(moonCode, info, options);
+}
+
+void Engine::CompileImpl(std::string_view moonCode, CompileInfo& info, CompileSink* sink, const CompileOptions& options, int optionsIndex, IncrementalUnit* unit) {
+    auto L = m_State.get();
+    ResetInfo(info);
+
+    // Preparing
+    // We don't need GC to slowdown transpilation, batch pauses it once for all of its sources
+    bool batch = optionsIndex != 0;
+    if (!batch) lua_gc(L, LUA_GCSTOP, 0);
+    // Peak includes memory which was already freed (e.g. buffers resized by lua), unlike memory_usage
+    auto allocator = get_allocator(L);
+    allocator->ResetPeak();
+    size_t used_before = allocator->Used();
+    std::shared_ptr<void> _(nullptr, [L, batch, allocator, used_before, &info](...) {
+        info.peak_memory = allocator->Peak() - used_before;
+        if (!batch) lua_gc(L, LUA_GCRESTART, 0);
+    });
+    info.memory_usage = lua_gc_count(L);
+    info.line_index.Build(moonCode);
+
+    // Parsing
+    info.parse_time = timestamp();
+    if (!(unit ? ParseIncremental(moonCode, info, options, *unit) : ParseImpl(moonCode, info, options))) return;
     info.parse_time = timestamp() - info.parse_time;
 
     // Compiling
     info.compile_time = timestamp();
     lua_rawgeti(L, LUA_REGISTRYINDEX, m_CompileTreeRef);
     lua_insert(L, -2);
-    push_moon_options(L, options);
+    if (optionsIndex != 0) lua_pushvalue(L, optionsIndex);
+    else push_moon_options(L, options);
     if (lua_pcall(L, 2, 3, 0) != 0) {
         std::string err = lua_tostring(L, -1); lua_pop(L, 1);
-        return CompileInfo::FromError(err, "failed to run compile.tree: " + err);
+        return info.SetError(err, "failed to run compile.tree: " + err);
     }
     if (lua_isnil(L, -3)) {
-        std::string msg, display_msg;
+        std::string msg = lua_tostring(L, -2);
         CompileInfo::Pos pos;
-        msg = lua_tostring(L, -2);
-        if (lua_isnumber(L, -1)) pos = OffsetToPos(moonCode, lua_tointeger(L, -1));
-        // Formatting error
-        lua_rawgeti(L, LUA_REGISTRYINDEX, m_CompileFormatErrorRef);
-        lua_insert(L, -3);
-        lua_pushlstring(L, moonCode.data(), moonCode.size());
-        if (lua_pcall(L, 3, 1, 0) == 0) { display_msg = lua_tostring(L, -1); }
-        lua_pop(L, 2);
-        return CompileInfo::FromError(msg, display_msg, pos);
+        if (lua_isnumber(L, -1)) {
+            int offset = lua_tointeger(L, -1);
+            auto [line, col] = info.line_index.OffsetToLine(offset);
+            pos = CompileInfo::Pos(offset, line, col);
+        }
+        lua_pop(L, 3);
+
+        info.SetError(msg, {}, pos);
+        info.error->formatted = false;
+        // format_error rescans the source, callers which only need position can skip it
+        if (options.format_errors) FormatError(moonCode, *info.error);
+        return;
     }
 
-    info.lua_code = lua_tostring(L, -3);
+    // Lua code is still owned by lua state here, so sink receives it without any copies
+    size_t code_len = 0;
+    const char* code = lua_tolstring(L, -3, &code_len);
+    if (sink) sink->Write({code, code_len});
+    else info.lua_code.assign(code, code_len);
+
     if (lua_istable(L, -2)) {
         lua_pushnil(L);
         while (lua_next(L, -3) != 0) {
-            size_t line = lua_tonumber(L, -2);
-            size_t pos = lua_tonumber(L, -1);
-            info.posmap.insert_or_assign(line, OffsetToPos(moonCode, pos));
+            int line = lua_tonumber(L, -2);
+            int offset = lua_tonumber(L, -1);
+            auto [source_line, col] = info.line_index.OffsetToLine(offset);
+            InsertPos(info, line, CompileInfo::Pos(offset, source_line, col));
             lua_pop(L, 1);
         }
     }
@@ -254,5 +670,4 @@ CompileInfo Engine::CompileString2(std::string_view moonCode, const CompileOptio
 
     info.compile_time = timestamp() - info.compile_time;
     info.memory_usage = lua_gc_count(L) - info.memory_usage;
-    return info;
 }
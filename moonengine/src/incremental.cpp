@@ -0,0 +1,159 @@
+#include "incremental.hpp"
+
+#include <cctype>
+
+#include "lua.hpp"
+
+using namespace MoonEngine;
+
+namespace {
+    enum class Mode { Code, Interpolation, SingleQuote, DoubleQuote, LongString };
+
+    struct Frame {
+        Mode mode;
+        int depth = 0; // open brackets, only for code
+        int level = 0; // number of '=' in long string brackets
+    };
+
+    inline bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    inline bool IsIdent(char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+    }
+
+    bool StartsWithWord(std::string_view code, size_t pos, std::string_view word) {
+        return code.compare(pos, word.size(), word) == 0
+            && (pos + word.size() >= code.size() || !IsIdent(code[pos + word.size()]));
+    }
+
+    // [==[ or ]==], returns number of '=' or -1 if there is no long bracket
+    int BracketLevel(std::string_view code, size_t pos, char bracket) {
+        size_t i = pos + 1;
+        while (i < code.size() && code[i] == '=') i++;
+        if (i >= code.size() || code[i] != bracket) return -1;
+        return static_cast<int>(i - pos - 1);
+    }
+
+    // Line starting at pos belongs to previous statement
+    bool ContinuesStatement(std::string_view code, size_t pos) {
+        char c = code[pos];
+        if (IsSpace(c)) return true; // Indented or empty line
+        if (code.compare(pos, 2, "--") == 0) return true; // Comments might be followed by else
+        if (c == ')' || c == ']' || c == '}' || c == '.' || c == '\\') return true;
+        return StartsWithWord(code, pos, "else") || StartsWithWord(code, pos, "elseif");
+    }
+
+    // Statement can't end with token which ends at given position
+    bool IsDangling(std::string_view code, size_t last) {
+        if (last >= code.size()) return false;
+
+        char c = code[last];
+        if (!IsIdent(c)) {
+            // Function arrow without body on the same line, body is empty if next line isn't indented
+            if (c == '>' && last > 0 && (code[last - 1] == '-' || code[last - 1] == '=')) return false;
+            constexpr std::string_view operators = ",=+-*/%^<>~|&:(.\\";
+            return operators.find(c) != std::string_view::npos;
+        }
+
+        size_t start = last;
+        while (start > 0 && IsIdent(code[start - 1])) start--;
+        std::string_view word = code.substr(start, last - start + 1);
+        return word == "and" || word == "or" || word == "not";
+    }
+}
+
+void MoonEngine::SplitStatements(std::string_view code, std::vector<std::string_view>& chunks) {
+    chunks.clear();
+
+    std::vector<Frame> frames = {{Mode::Code}};
+    size_t start = 0;
+    size_t last = std::string_view::npos; // Last significant char of code
+    for (size_t i = 0; i < code.size(); i++) {
+        if (i > 0 && code[i - 1] == '\n' && frames.size() == 1 && frames[0].depth == 0
+            && !ContinuesStatement(code, i) && !IsDangling(code, last)) {
+            chunks.push_back(code.substr(start, i - start));
+            start = i;
+        }
+
+        char c = code[i];
+        Frame& frame = frames.back();
+        switch (frame.mode) {
+            case Mode::SingleQuote:
+            case Mode::DoubleQuote:
+                if (c == '\\') i++;
+                else if (c == (frame.mode == Mode::SingleQuote ? '\'' : '"')) {
+                    last = i;
+                    frames.pop_back();
+                }
+                else if (frame.mode == Mode::DoubleQuote && c == '#' && i + 1 < code.size() && code[i + 1] == '{') {
+                    frames.push_back({Mode::Interpolation});
+                    i++;
+                }
+                break;
+            case Mode::LongString:
+                if (c == ']' && BracketLevel(code, i, ']') == frame.level) {
+                    i += frame.level + 1;
+                    last = i;
+                    frames.pop_back();
+                }
+                break;
+            case Mode::Code:
+            case Mode::Interpolation: {
+                if (IsSpace(c)) break;
+                if (c == '-' && i + 1 < code.size() && code[i + 1] == '-') {
+                    // Comment lasts until the end of line
+                    while (i + 1 < code.size() && code[i + 1] != '\n') i++;
+                    break;
+                }
+
+                last = i;
+                int level = -1;
+                if (c == '\'') frames.push_back({Mode::SingleQuote});
+                else if (c == '"') frames.push_back({Mode::DoubleQuote});
+                else if (c == '[' && (level = BracketLevel(code, i, '[')) >= 0) {
+                    frames.push_back({Mode::LongString, 0, level});
+                    i += level + 1;
+                }
+                else if (c == '(' || c == '[' || c == '{') frame.depth++;
+                else if (c == ')' || c == ']' || c == '}') {
+                    if (frame.depth > 0) frame.depth--;
+                    else if (frame.mode == Mode::Interpolation && c == '}') frames.pop_back();
+                }
+                break;
+            }
+        }
+    }
+
+    if (start < code.size())
+        chunks.push_back(code.substr(start));
+}
+
+bool MoonEngine::CopyTree(lua_State* L, int offset) {
+    if (!lua_istable(L, -1)) return true;
+    if (!lua_checkstack(L, 4)) return false;
+
+    int src = lua_gettop(L);
+    lua_createtable(L, static_cast<int>(lua_rawlen(L, src)), 1);
+    lua_pushnil(L);
+    while (lua_next(L, src) != 0) {
+        if (lua_istable(L, -1)) {
+            if (!CopyTree(L, offset)) {
+                lua_settop(L, src);
+                return false;
+            }
+        } else if (lua_type(L, -1) == LUA_TNUMBER && lua_type(L, -2) == LUA_TNUMBER && lua_tointeger(L, -2) == -1) {
+            lua_Integer pos = lua_tointeger(L, -1) + offset;
+            lua_pop(L, 1);
+            lua_pushinteger(L, pos);
+        }
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, src + 1);
+    }
+    if (lua_getmetatable(L, src))
+        lua_setmetatable(L, src + 1);
+    lua_remove(L, src);
+    return true;
+}
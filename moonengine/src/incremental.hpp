@@ -0,0 +1,23 @@
+#ifndef MOONENGINE_INCREMENTAL_HPP
+#define MOONENGINE_INCREMENTAL_HPP
+
+#pragma once
+
+#include <string_view>
+#include <vector>
+
+struct lua_State;
+
+namespace MoonEngine {
+    // Splits moonscript source into chunks of top-level statements, chunks cover the whole source.
+    // Chunk starts only at unindented line outside of brackets and strings, which doesn't continue
+    // previous statement (else/elseif, dangling operator, etc.). Splitting is conservative,
+    // if in doubt lines are kept in the same chunk.
+    void SplitStatements(std::string_view code, std::vector<std::string_view>& chunks);
+
+    // Replaces parse tree at the top of the stack with its deep copy,
+    // positions of nodes ([-1] fields) are shifted by given offset
+    bool CopyTree(lua_State* L, int offset);
+}
+
+#endif // MOONENGINE_INCREMENTAL_HPP
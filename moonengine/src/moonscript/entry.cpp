@@ -9,49 +9,40 @@
 
 CMRC_DECLARE(MoonEngine);
 
-class PreloadFileException : public std::exception {
-    std::string _fileName;
-    std::string _error;
+// Resolves module name to embedded file path
+// moonscript.parse -> moonscript/parse.lua or moonscript/parse/init.lua
+inline std::string find_embedded_module(const cmrc::embedded_filesystem& fs, std::string_view name) {
+    std::string path(name);
+    std::replace(path.begin(), path.end(), '.', '/'); // Replace '.' to '/'
 
-public:
-    PreloadFileException(std::string_view fileName, std::string_view error) : _fileName(fileName), _error(error) {}
+    if (fs.is_file(path + ".lua"))
+        return path + ".lua";
+    if (fs.is_file(path + "/init.lua"))
+        return path + "/init.lua";
+    return {};
+}
 
-    virtual const char* what() const noexcept {
-        return _error.c_str();
-    }
+// package.searchers entry, which loads modules from embedded filesystem only when they are required
+int embedded_searcher(lua_State* L) {
+    auto fs = cmrc::MoonEngine::get_filesystem();
+    const char* name = luaL_checkstring(L, 1);
 
-    virtual const char* filename() const noexcept {
-        return _fileName.c_str();
+    std::string filePath = find_embedded_module(fs, name);
+    if (filePath.empty()) {
+        lua_pushfstring(L, "\n\tno embedded file '%s'", name);
+        return 1;
     }
-};
 
-void preload_file(lua_State* L, std::string filePath) {
-    auto fs = cmrc::MoonEngine::get_filesystem();
-
-    lua_getglobal(L, "package");
-    lua_getfield(L, -1, "preload");
     auto file = fs.open(filePath);
-    if (luaL_loadstring(L, file.begin()) != 0) {
-        throw PreloadFileException(filePath, lua_tostring(L, -1));
+    // Embedded file can be either a plain source or a precompiled bytecode
+    std::string chunkName = "@" + filePath;
+    if (luaL_loadbuffer(L, file.begin(), file.size(), chunkName.c_str()) != 0) {
+        return luaL_error(L, "error loading module '%s' from embedded file '%s':\n\t%s",
+            name, filePath.c_str(), lua_tostring(L, -1));
     }
 
-    // Modify our filePath, so it can be as package path
-    filePath = filePath.substr(0, filePath.size() - 4); // Remove .lua extension
-    std::replace(filePath.begin(), filePath.end(), '/', '.'); // Replace '/' to '.'
-
-    lua_setfield(L, -2, filePath.c_str()); // Set our compiled string to preload table
-    lua_pop(L, 2); // Pop preload table
-}
-
-void preload_folder(lua_State* L, std::string dir) {
-    auto fs = cmrc::MoonEngine::get_filesystem();
-    for (const auto& f : fs.iterate_directory(dir)) {
-        std::string filePath = dir + "/" + f.filename();
-        if (f.is_directory())
-            preload_folder(L, filePath);
-        else
-            preload_file(L, filePath);
-    }
+    lua_pushstring(L, filePath.c_str()); // Passed to the loader as second argument
+    return 2;
 }
 
 int luaopen_moonscript(lua_State* L) {
@@ -59,15 +50,21 @@ int luaopen_moonscript(lua_State* L) {
     lua_getfield(L, -1, "preload");
     lua_pushcfunction(L, luaopen_lpeg);
     lua_setfield(L, -2, "lpeg");
-    lua_pop(L, 2); // Pop preload table
+    lua_pop(L, 1); // Pop preload table
+
+    // Insert our searcher right after preload searcher
+    lua_getfield(L, -1, "searchers");
+    if (!lua_istable(L, -1))
+        return luaL_error(L, "package.searchers is not a table");
 
-    try {
-        preload_folder(L, "moonscript");
-    } catch (const PreloadFileException& e) {
-        luaL_error(L, "failed to preload file \"%s\": %s", e.filename(), e.what());
-    } catch (const std::exception& e) {
-        luaL_error(L, e.what());
+    int len = static_cast<int>(lua_rawlen(L, -1));
+    for (int i = len; i >= 2; i--) {
+        lua_rawgeti(L, -1, i);
+        lua_rawseti(L, -2, i + 1);
     }
+    lua_pushcfunction(L, embedded_searcher);
+    lua_rawseti(L, -2, 2);
+    lua_pop(L, 2); // Pop searchers and package tables
 
     return 0;
 }
@@ -0,0 +1,2074 @@
+#include "parser.hpp"
+
+#include <vector>
+#include <utility>
+
+#include "lua.hpp"
+
+using namespace MoonEngine;
+
+// Rules below follow moonscript/parse.moon one to one, including order of alternatives
+// and side effects of indent/do stacks on backtracking, so trees are identical.
+// Anything that could make LPeg grammar behave differently (lua errors raised by grammar,
+// syntax which is not present in every moonscript version) aborts parsing instead.
+
+namespace {
+    constexpr int MAX_DEPTH = 200;
+
+    struct Unsupported {};
+
+    // Lua value produced by grammar capture
+    struct Node {
+        enum Type : unsigned char { Nil, String, Number, Table };
+        Type type = Nil;
+        int number = 0;
+        int pos = 0; // [-1] field of table, set by pos() in grammar
+        std::string_view str;
+        std::vector<Node> items;
+    };
+
+    Node Str(std::string_view str) {
+        Node node;
+        node.type = Node::String;
+        node.str = str;
+        return node;
+    }
+
+    Node Num(int number) {
+        Node node;
+        node.type = Node::Number;
+        node.number = number;
+        return node;
+    }
+
+    Node Tbl() {
+        Node node;
+        node.type = Node::Table;
+        return node;
+    }
+
+    // mark"name" -> {name, ...}
+    template<class... Items>
+    Node Mark(std::string_view name, Items&&... items) {
+        Node node = Tbl();
+        node.items.reserve(1 + sizeof...(items));
+        node.items.push_back(Str(name));
+        (node.items.push_back(std::forward<Items>(items)), ...);
+        return node;
+    }
+
+    // Ct(patt) with a single capture
+    Node Wrap(Node&& item) {
+        Node node = Tbl();
+        node.items.push_back(std::move(item));
+        return node;
+    }
+
+    void SetPos(Node& node, size_t offset) {
+        if (node.type == Node::Table) node.pos = static_cast<int>(offset) + 1;
+    }
+
+    // ntype from moonscript.types
+    std::string_view NodeType(const Node& node) {
+        switch (node.type) {
+            case Node::Nil: return "nil";
+            case Node::Table:
+                return !node.items.empty() && node.items[0].type == Node::String ? node.items[0].str : std::string_view();
+            default: return "value";
+        }
+    }
+
+    bool IsAssignable(const Node& node) {
+        if (node.type == Node::String && node.str == "...") return false;
+        auto type = NodeType(node);
+        if (type == "ref" || type == "self" || type == "value" || type == "self_class" || type == "table")
+            return true;
+        if (type == "chain") {
+            auto last = NodeType(node.items.back());
+            return last == "index" || last == "dot" || last == "slice";
+        }
+        return false;
+    }
+
+    Node Flatten(std::string_view name, Node&& tbl) {
+        if (tbl.items.size() == 1) return std::move(tbl.items[0]);
+        tbl.items.insert(tbl.items.begin(), Str(name));
+        return std::move(tbl);
+    }
+
+    Node FormatAssign(Node&& exps, Node&& assign) {
+        // Grammar raises an error from a capture here, let LPeg report it
+        for (const auto& exp : exps.items)
+            if (!IsAssignable(exp)) throw Unsupported();
+
+        Node result = NodeType(assign) == "assign"
+            ? Mark("assign", std::move(exps))
+            : Mark("update", std::move(exps.items[0]));
+        for (size_t i = 1; i < assign.items.size(); i++)
+            result.items.push_back(std::move(assign.items[i]));
+        return result;
+    }
+
+    bool IsAlpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; }
+    bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+    bool IsAlphaNum(char c) { return IsAlpha(c) || IsDigit(c); }
+    bool IsHex(char c) { return IsDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'); }
+
+    bool IsKeyword(std::string_view name) {
+        static constexpr std::string_view keywords[] = {
+            "and", "break", "class", "continue", "do", "else", "elseif", "export", "extends", "for",
+            "from", "if", "import", "in", "local", "not", "or", "return", "switch", "then",
+            "unless", "using", "when", "while", "with",
+        };
+        for (auto keyword : keywords)
+            if (keyword == name) return true;
+        return false;
+    }
+
+    class Parser {
+        std::string_view m_Src;
+        size_t m_Pos = 0;
+        std::vector<int> m_Indent = {0};
+        std::vector<bool> m_Do = {true};
+        int m_Depth = 0;
+
+        struct DepthGuard {
+            Parser& parser;
+            explicit DepthGuard(Parser& parser) : parser(parser) {
+                if (++parser.m_Depth > MAX_DEPTH) throw Unsupported();
+            }
+            ~DepthGuard() { parser.m_Depth--; }
+        };
+
+        bool Eof() const { return m_Pos >= m_Src.size(); }
+        char Peek(size_t offset = 0) const { return m_Pos + offset < m_Src.size() ? m_Src[m_Pos + offset] : '\0'; }
+        bool LookLit(std::string_view str) const { return m_Src.substr(m_Pos, str.size()) == str; }
+        bool Lit(std::string_view str) {
+            if (!LookLit(str)) return false;
+            m_Pos += str.size();
+            return true;
+        }
+        std::string_view Slice(size_t begin) const { return m_Src.substr(begin, m_Pos - begin); }
+
+        // Literals
+
+        bool LookStop() const { return Eof() || Peek() == '\n' || (Peek() == '\r' && Peek(1) == '\n'); }
+
+        bool Break() {
+            if (Peek() == '\n') { m_Pos++; return true; }
+            if (Peek() == '\r' && Peek(1) == '\n') { m_Pos += 2; return true; }
+            return false;
+        }
+
+        bool Breaks() {
+            if (!Break()) return false;
+            while (Break()) {}
+            return true;
+        }
+
+        bool Comment() {
+            size_t start = m_Pos;
+            if (!Lit("--")) return false;
+            while (!Eof() && Peek() != '\r' && Peek() != '\n') m_Pos++;
+            if (LookStop()) return true;
+            m_Pos = start;
+            return false;
+        }
+
+        void Space() {
+            while (Peek() == ' ' || Peek() == '\t') m_Pos++;
+            Comment();
+        }
+
+        bool LookSomeSpace() const { return Peek() == ' ' || Peek() == '\t'; }
+
+        bool SpaceBreak() {
+            size_t start = m_Pos;
+            Space();
+            if (Break()) return true;
+            m_Pos = start;
+            return false;
+        }
+
+        void SpaceBreaks() { while (SpaceBreak()) {} }
+
+        void White() {
+            while (Peek() == ' ' || Peek() == '\t' || Peek() == '\r' || Peek() == '\n') m_Pos++;
+        }
+
+        void Shebang() {
+            if (!Lit("#!")) return;
+            while (!LookStop()) m_Pos++;
+        }
+
+        bool RawName(std::string_view& out) {
+            if (!IsAlpha(Peek())) return false;
+            size_t begin = m_Pos;
+            while (IsAlphaNum(Peek())) m_Pos++;
+            out = Slice(begin);
+            return true;
+        }
+
+        bool Name(std::string_view& out) {
+            size_t start = m_Pos;
+            Space();
+            std::string_view name;
+            if (RawName(name) && !IsKeyword(name)) {
+                out = name;
+                return true;
+            }
+            m_Pos = start;
+            return false;
+        }
+
+        bool Key(std::string_view keyword) {
+            size_t start = m_Pos;
+            Space();
+            if (Lit(keyword) && !IsAlphaNum(Peek())) return true;
+            m_Pos = start;
+            return false;
+        }
+
+        bool Sym(std::string_view chars) {
+            size_t start = m_Pos;
+            Space();
+            if (Lit(chars)) return true;
+            m_Pos = start;
+            return false;
+        }
+
+        bool VarArg() { return Sym("..."); }
+
+        bool NumberLiteral() {
+            size_t start = m_Pos;
+            if (Lit("0x")) {
+                if (IsHex(Peek())) {
+                    while (IsHex(Peek())) m_Pos++;
+                    return true;
+                }
+                m_Pos = start;
+            }
+
+            if (IsDigit(Peek())) {
+                while (IsDigit(Peek())) m_Pos++;
+                if (Peek() == '.' && IsDigit(Peek(1))) {
+                    m_Pos++;
+                    while (IsDigit(Peek())) m_Pos++;
+                }
+            } else if (Peek() == '.' && IsDigit(Peek(1))) {
+                m_Pos++;
+                while (IsDigit(Peek())) m_Pos++;
+            } else {
+                return false;
+            }
+
+            size_t save = m_Pos;
+            if (Peek() == 'e' || Peek() == 'E') {
+                m_Pos++;
+                if (Peek() == '-') m_Pos++;
+                if (IsDigit(Peek())) {
+                    while (IsDigit(Peek())) m_Pos++;
+                } else {
+                    m_Pos = save;
+                }
+            }
+            return true;
+        }
+
+        // Indentation and do stacks
+
+        int Indent() {
+            int sum = 0;
+            for (;; m_Pos++) {
+                if (Peek() == ' ') sum += 1;
+                else if (Peek() == '\t') sum += 4;
+                else break;
+            }
+            return sum;
+        }
+
+        bool CheckIndent() {
+            size_t start = m_Pos;
+            int indent = Indent();
+            if (!m_Indent.empty() && m_Indent.back() == indent) return true;
+            m_Pos = start;
+            return false;
+        }
+
+        bool Advance() {
+            size_t start = m_Pos;
+            int indent = Indent();
+            m_Pos = start;
+            if (m_Indent.empty()) throw Unsupported();
+            int top = m_Indent.back();
+            if (top == -1 || indent <= top) return false;
+            m_Indent.push_back(indent);
+            return true;
+        }
+
+        void PushIndent() { m_Indent.push_back(Indent()); }
+        void PreventIndent() { m_Indent.push_back(-1); }
+        void PopIndent() {
+            if (m_Indent.empty()) throw Unsupported();
+            m_Indent.pop_back();
+        }
+
+        void DisableDo() { m_Do.push_back(false); }
+        void PopDo() {
+            if (m_Do.empty()) throw Unsupported();
+            m_Do.pop_back();
+        }
+        bool CheckDo() const { return m_Do.empty() || m_Do.back(); }
+
+        // Blocks and statements
+
+        bool Block(Node& out) {
+            DepthGuard guard(*this);
+            Node block = Tbl();
+            if (!Line(block.items)) return false;
+            while (true) {
+                size_t save = m_Pos;
+                if (Breaks() && Line(block.items)) continue;
+                m_Pos = save;
+                break;
+            }
+            out = std::move(block);
+            return true;
+        }
+
+        bool Line(std::vector<Node>& out) {
+            size_t start = m_Pos;
+            if (CheckIndent()) {
+                Node stm;
+                if (Statement(stm)) {
+                    out.push_back(std::move(stm));
+                    return true;
+                }
+                m_Pos = start;
+            }
+            Space();
+            if (LookStop()) return true;
+            m_Pos = start;
+            return false;
+        }
+
+        bool Statement(Node& out) {
+            DepthGuard guard(*this);
+            size_t start = m_Pos;
+            Node stm;
+            if (!(Import(stm) || While(stm) || With(stm) || For(stm) || ForEach(stm) || Switch(stm)
+                || Return(stm) || Local(stm) || Export(stm) || BreakLoop(stm) || ExpAssign(stm)))
+                return false;
+            SetPos(stm, start);
+
+            Space();
+            size_t save = m_Pos;
+            Node decorator;
+            if (Decorator(decorator)) {
+                Space();
+                out = Mark("decorated", std::move(stm), std::move(decorator));
+            } else {
+                m_Pos = save;
+                out = std::move(stm);
+            }
+            return true;
+        }
+
+        bool Decorator(Node& out) {
+            size_t start = m_Pos;
+            Node exp;
+            if (Key("if")) {
+                if (Exp(exp)) {
+                    Node decorator = Mark("if", std::move(exp));
+                    size_t save = m_Pos;
+                    Node other;
+                    if (Key("else") && Exp(other)) decorator.items.push_back(std::move(other));
+                    else m_Pos = save;
+                    Space();
+                    out = std::move(decorator);
+                    return true;
+                }
+                m_Pos = start;
+            }
+            if (Key("unless")) {
+                if (Exp(exp)) {
+                    out = Mark("unless", std::move(exp));
+                    return true;
+                }
+                m_Pos = start;
+            }
+            Node inner;
+            if (CompInner(inner)) {
+                out = Mark("comprehension", std::move(inner));
+                return true;
+            }
+            return false;
+        }
+
+        bool Body(Node& out) {
+            size_t start = m_Pos;
+            Space();
+            if (Break()) {
+                SpaceBreaks();
+                if (InBlock(out)) return true;
+            }
+            m_Pos = start;
+            Node stm;
+            if (!Statement(stm)) return false;
+            out = Wrap(std::move(stm));
+            return true;
+        }
+
+        bool InBlock(Node& out) {
+            size_t start = m_Pos;
+            if (!Advance()) return false;
+            Node block;
+            if (!Block(block)) {
+                m_Pos = start;
+                return false;
+            }
+            PopIndent();
+            out = std::move(block);
+            return true;
+        }
+
+        bool Local(Node& out) {
+            size_t start = m_Pos;
+            if (!Key("local")) return false;
+            if (Sym("*")) { out = Mark("declare_glob", Str("*")); return true; }
+            if (Sym("^")) { out = Mark("declare_glob", Str("^")); return true; }
+            Node names = Tbl();
+            if (NameList(names.items)) {
+                out = Mark("declare_with_shadows", std::move(names));
+                return true;
+            }
+            m_Pos = start;
+            return false;
+        }
+
+        bool Import(Node& out) {
+            size_t start = m_Pos;
+            if (!Key("import")) return false;
+            Node names = Tbl();
+            if (ImportNameList(names.items)) {
+                SpaceBreaks();
+                Node from;
+                if (Key("from") && Exp(from)) {
+                    out = Mark("import", std::move(names), std::move(from));
+                    return true;
+                }
+            }
+            m_Pos = start;
+            return false;
+        }
+
+        bool ImportName(Node& out) {
+            size_t start = m_Pos;
+            std::string_view name;
+            if (Sym("\\")) {
+                if (Name(name)) {
+                    out = Mark("colon", Str(name));
+                    return true;
+                }
+                m_Pos = start;
+            }
+            if (!Name(name)) return false;
+            out = Str(name);
+            return true;
+        }
+
+        bool ImportNameList(std::vector<Node>& out) {
+            size_t start = m_Pos;
+            SpaceBreaks();
+            Node name;
+            if (!ImportName(name)) {
+                m_Pos = start;
+                return false;
+            }
+            out.push_back(std::move(name));
+            while (true) {
+                size_t save = m_Pos;
+                bool separated = false;
+                if (SpaceBreak()) {
+                    SpaceBreaks();
+                    separated = true;
+                } else if (Sym(",")) {
+                    SpaceBreaks();
+                    separated = true;
+                }
+                if (separated && ImportName(name)) {
+                    out.push_back(std::move(name));
+                    continue;
+                }
+                m_Pos = save;
+                break;
+            }
+            return true;
+        }
+
+        bool BreakLoop(Node& out) {
+            if (Key("break")) { out = Mark("break"); return true; }
+            if (Key("continue")) { out = Mark("continue"); return true; }
+            return false;
+        }
+
+        bool Return(Node& out) {
+            if (!Key("return")) return false;
+            Node values = Mark("explist");
+            if (ExpListLow(values.items)) out = Mark("return", std::move(values));
+            else out = Mark("return", Str(""));
+            return true;
+        }
+
+        bool WithExp(Node& out) {
+            Node exps = Tbl();
+            if (!ExpList(exps.items)) return false;
+            Node assign;
+            if (Assign(assign)) out = FormatAssign(std::move(exps), std::move(assign));
+            else out = Flatten("explist", std::move(exps));
+            return true;
+        }
+
+        bool With(Node& out) {
+            size_t start = m_Pos;
+            if (!Key("with")) return false;
+            DisableDo();
+            Node exp;
+            if (!WithExp(exp)) {
+                PopDo();
+                m_Pos = start;
+                return false;
+            }
+            PopDo();
+            Key("do");
+            Node body;
+            if (!Body(body)) {
+                m_Pos = start;
+                return false;
+            }
+            out = Mark("with", std::move(exp), std::move(body));
+            return true;
+        }
+
+        bool Switch(Node& out) {
+            size_t start = m_Pos;
+            if (!Key("switch")) return false;
+            DisableDo();
+            Node exp;
+            if (!Exp(exp)) {
+                PopDo();
+                m_Pos = start;
+                return false;
+            }
+            PopDo();
+            Key("do");
+            Space();
+            Node block;
+            if (!(Break() && SwitchBlock(block))) {
+                m_Pos = start;
+                return false;
+            }
+            out = Mark("switch", std::move(exp), std::move(block));
+            return true;
+        }
+
+        bool SwitchBlock(Node& out) {
+            size_t start = m_Pos;
+            SpaceBreaks();
+            if (!Advance()) {
+                m_Pos = start;
+                return false;
+            }
+            Node cases = Tbl();
+            Node item;
+            if (!SwitchCase(item)) {
+                m_Pos = start;
+                return false;
+            }
+            cases.items.push_back(std::move(item));
+            while (true) {
+                size_t save = m_Pos;
+                if (Breaks() && SwitchCase(item)) {
+                    cases.items.push_back(std::move(item));
+                    continue;
+                }
+                m_Pos = save;
+                break;
+            }
+            size_t save = m_Pos;
+            if (Breaks() && SwitchElse(item)) cases.items.push_back(std::move(item));
+            else m_Pos = save;
+            PopIndent();
+            out = std::move(cases);
+            return true;
+        }
+
+        bool SwitchCase(Node& out) {
+            size_t start = m_Pos;
+            if (!Key("when")) return false;
+            Node exps = Tbl();
+            if (ExpList(exps.items)) {
+                Key("then");
+                Node body;
+                if (Body(body)) {
+                    out = Mark("case", std::move(exps), std::move(body));
+                    return true;
+                }
+            }
+            m_Pos = start;
+            return false;
+        }
+
+        bool SwitchElse(Node& out) {
+            size_t start = m_Pos;
+            if (!Key("else")) return false;
+            Node body;
+            if (!Body(body)) {
+                m_Pos = start;
+                return false;
+            }
+            out = Mark("else", std::move(body));
+            return true;
+        }
+
+        bool IfCond(Node& out) {
+            Node exp;
+            if (!Exp(exp)) return false;
+            Node assign;
+            if (Assign(assign)) out = FormatAssign(Wrap(std::move(exp)), std::move(assign));
+            else out = std::move(exp);
+            return true;
+        }
+
+        // (Break * EmptyLine^0 * CheckIndent)^-1
+        void BranchLine() {
+            size_t start = m_Pos;
+            if (Break()) {
+                SpaceBreaks();
+                if (CheckIndent()) return;
+            }
+            m_Pos = start;
+        }
+
+        bool IfElseIf(Node& out) {
+            size_t start = m_Pos;
+            BranchLine();
+            if (Key("elseif")) {
+                size_t cond_start = m_Pos;
+                Node cond;
+                if (IfCond(cond)) {
+                    SetPos(cond, cond_start);
+                    Key("then");
+                    Node body;
+                    if (Body(body)) {
+                        out = Mark("elseif", std::move(cond), std::move(body));
+                        return true;
+                    }
+                }
+            }
+            m_Pos = start;
+            return false;
+        }
+
+        bool IfElse(Node& out) {
+            size_t start = m_Pos;
+            BranchLine();
+            Node body;
+            if (Key("else") && Body(body)) {
+                out = Mark("else", std::move(body));
+                return true;
+            }
+            m_Pos = start;
+            return false;
+        }
+
+        // If and Unless, keyword is also name of the node
+        bool If(std::string_view keyword, Node& out) {
+            size_t start = m_Pos;
+            if (!Key(keyword)) return false;
+            Node cond;
+            if (IfCond(cond)) {
+                Key("then");
+                Node body;
+                if (Body(body)) {
+                    Node result = Mark(keyword, std::move(cond), std::move(body));
+                    Node branch;
+                    while (IfElseIf(branch)) result.items.push_back(std::move(branch));
+                    if (IfElse(branch)) result.items.push_back(std::move(branch));
+                    out = std::move(result);
+                    return true;
+                }
+            }
+            m_Pos = start;
+            return false;
+        }
+
+        bool While(Node& out) {
+            size_t start = m_Pos;
+            if (!Key("while")) return false;
+            DisableDo();
+            Node cond;
+            if (!Exp(cond)) {
+                PopDo();
+                m_Pos = start;
+                return false;
+            }
+            PopDo();
+            Key("do");
+            Node body;
+            if (!Body(body)) {
+                m_Pos = start;
+                return false;
+            }
+            out = Mark("while", std::move(cond), std::move(body));
+            return true;
+        }
+
+        // Exp * sym"," * Exp * (sym"," * Exp)^-1
+        bool ForRange(std::vector<Node>& out) {
+            size_t start = m_Pos;
+            Node first, last;
+            if (!(Exp(first) && Sym(",") && Exp(last))) {
+                m_Pos = start;
+                return false;
+            }
+            out.push_back(std::move(first));
+            out.push_back(std::move(last));
+            size_t save = m_Pos;
+            Node step;
+            if (Sym(",") && Exp(step)) out.push_back(std::move(step));
+            else m_Pos = save;
+            return true;
+        }
+
+        bool For(Node& out) {
+            size_t start = m_Pos;
+            if (!Key("for")) return false;
+            DisableDo();
+            std::string_view name;
+            Node range = Tbl();
+            if (!(Name(name) && Sym("=") && ForRange(range.items))) {
+                PopDo();
+                m_Pos = start;
+                return false;
+            }
+            PopDo();
+            Key("do");
+            Node body;
+            if (!Body(body)) {
+                m_Pos = start;
+                return false;
+            }
+            out = Mark("for", Str(name), std::move(range), std::move(body));
+            return true;
+        }
+
+        bool ForEach(Node& out) {
+            size_t start = m_Pos;
+            if (!Key("for")) return false;
+            Node names = Tbl();
+            if (!(AssignableNameList(names.items) && Key("in"))) {
+                m_Pos = start;
+                return false;
+            }
+            DisableDo();
+            Node iter = Tbl();
+            size_t save = m_Pos;
+            Node exp;
+            bool matched = false;
+            if (Sym("*")) {
+                if (Exp(exp)) {
+                    iter.items.push_back(Mark("unpack", std::move(exp)));
+                    matched = true;
+                } else {
+                    m_Pos = save;
+                }
+            }
+            if (!matched && !ExpList(iter.items)) {
+                PopDo();
+                m_Pos = start;
+                return false;
+            }
+            PopDo();
+            Key("do");
+            Node body;
+            if (!Body(body)) {
+                m_Pos = start;
+                return false;
+            }
+            out = Mark("foreach", std::move(names), std::move(iter), std::move(body));
+            return true;
+        }
+
+        bool Do(Node& out) {
+            size_t start = m_Pos;
+            if (!Key("do")) return false;
+            Node body;
+            if (!Body(body)) {
+                m_Pos = start;
+                return false;
+            }
+            out = Mark("do", std::move(body));
+            return true;
+        }
+
+        // Comprehensions
+
+        bool CompInner(Node& out) {
+            Node clause;
+            if (!(CompForEach(clause) || CompFor(clause))) return false;
+            Node inner = Wrap(std::move(clause));
+            while (CompClause(clause)) inner.items.push_back(std::move(clause));
+            out = std::move(inner);
+            return true;
+        }
+
+        bool CompForEach(Node& out) {
+            size_t start = m_Pos;
+            if (!Key("for")) return false;
+            Node names = Tbl();
+            if (AssignableNameList(names.items) && Key("in")) {
+                size_t save = m_Pos;
+                Node exp;
+                if (Sym("*")) {
+                    if (Exp(exp)) {
+                        out = Mark("foreach", std::move(names), Mark("unpack", std::move(exp)));
+                        return true;
+                    }
+                    m_Pos = save;
+                }
+                if (Exp(exp)) {
+                    out = Mark("foreach", std::move(names), std::move(exp));
+                    return true;
+                }
+            }
+            m_Pos = start;
+            return false;
+        }
+
+        bool CompFor(Node& out) {
+            size_t start = m_Pos;
+            std::string_view name;
+            Node range = Tbl();
+            if (Key("for") && Name(name) && Sym("=") && ForRange(range.items)) {
+                out = Mark("for", Str(name), std::move(range));
+                return true;
+            }
+            m_Pos = start;
+            return false;
+        }
+
+        bool CompClause(Node& out) {
+            if (CompFor(out) || CompForEach(out)) return true;
+            size_t start = m_Pos;
+            if (Key("when")) {
+                Node exp;
+                if (Exp(exp)) {
+                    out = Mark("when", std::move(exp));
+                    return true;
+                }
+                m_Pos = start;
+            }
+            return false;
+        }
+
+        bool Comprehension(Node& out) {
+            size_t start = m_Pos;
+            if (!Sym("[")) return false;
+            Node exp, inner;
+            if (Exp(exp) && CompInner(inner) && Sym("]")) {
+                out = Mark("comprehension", std::move(exp), std::move(inner));
+                return true;
+            }
+            m_Pos = start;
+            return false;
+        }
+
+        bool TblComprehension(Node& out) {
+            size_t start = m_Pos;
+            if (!Sym("{")) return false;
+            Node exp;
+            if (Exp(exp)) {
+                Node exps = Wrap(std::move(exp));
+                size_t save = m_Pos;
+                if (Sym(",") && Exp(exp)) exps.items.push_back(std::move(exp));
+                else m_Pos = save;
+                Node inner;
+                if (CompInner(inner) && Sym("}")) {
+                    out = Mark("tblcomprehension", std::move(exps), std::move(inner));
+                    return true;
+                }
+            }
+            m_Pos = start;
+            return false;
+        }
+
+        // Assignments
+
+        bool Assign(Node& out) {
+            size_t start = m_Pos;
+            if (!Sym("=")) return false;
+            Node values = Tbl();
+            Node value;
+            if (With(value) || If("if", value) || Switch(value) || TableBlock(value)) {
+                values.items.push_back(std::move(value));
+            } else if (!ExpListLow(values.items)) {
+                m_Pos = start;
+                return false;
+            }
+            out = Mark("assign", std::move(values));
+            return true;
+        }
+
+        bool Update(Node& out) {
+            static constexpr std::string_view operators[] = {"..=", "+=", "-=", "*=", "/=", "%=", "or=", "and="};
+            size_t start = m_Pos;
+            Space();
+            std::string_view op;
+            for (auto candidate : operators) {
+                if (LookLit(candidate)) {
+                    op = candidate;
+                    break;
+                }
+            }
+            if (op.empty()) {
+                // Bitwise updates are not present in every moonscript version
+                if (LookLit("&=") || LookLit("|=") || LookLit(">>=") || LookLit("<<=")) throw Unsupported();
+                m_Pos = start;
+                return false;
+            }
+            m_Pos += op.size();
+            Node exp;
+            if (!Exp(exp)) {
+                m_Pos = start;
+                return false;
+            }
+            out = Mark("update", Str(op), std::move(exp));
+            return true;
+        }
+
+        bool ExpAssign(Node& out) {
+            Node exps = Tbl();
+            if (!ExpList(exps.items)) return false;
+            Node assign;
+            if (Update(assign) || Assign(assign)) out = FormatAssign(std::move(exps), std::move(assign));
+            else out = Flatten("explist", std::move(exps));
+            return true;
+        }
+
+        bool Export(Node& out) {
+            size_t start = m_Pos;
+            if (!Key("export")) return false;
+            Node node;
+            if (ClassDecl(node)) { out = Mark("export", Str("class"), std::move(node)); return true; }
+            if (Sym("*")) { out = Mark("export", Str("*")); return true; }
+            if (Sym("^")) { out = Mark("export", Str("^")); return true; }
+            Node names = Tbl();
+            if (NameList(names.items)) {
+                Node result = Mark("export", std::move(names));
+                size_t save = m_Pos;
+                Node values = Tbl();
+                if (Sym("=") && ExpListLow(values.items)) result.items.push_back(std::move(values));
+                else m_Pos = save;
+                out = std::move(result);
+                return true;
+            }
+            m_Pos = start;
+            return false;
+        }
+
+        // Lists
+
+        bool NameList(std::vector<Node>& out) {
+            std::string_view name;
+            if (!Name(name)) return false;
+            out.push_back(Str(name));
+            while (true) {
+                size_t save = m_Pos;
+                if (Sym(",") && Name(name)) {
+                    out.push_back(Str(name));
+                    continue;
+                }
+                m_Pos = save;
+                break;
+            }
+            return true;
+        }
+
+        bool NameOrDestructure(Node& out) {
+            std::string_view name;
+            if (Name(name)) {
+                out = Str(name);
+                return true;
+            }
+            return TableLit(out);
+        }
+
+        bool AssignableNameList(std::vector<Node>& out) {
+            Node name;
+            if (!NameOrDestructure(name)) return false;
+            out.push_back(std::move(name));
+            while (true) {
+                size_t save = m_Pos;
+                if (Sym(",") && NameOrDestructure(name)) {
+                    out.push_back(std::move(name));
+                    continue;
+                }
+                m_Pos = save;
+                break;
+            }
+            return true;
+        }
+
+        bool ExpList(std::vector<Node>& out) {
+            Node exp;
+            if (!Exp(exp)) return false;
+            out.push_back(std::move(exp));
+            while (true) {
+                size_t save = m_Pos;
+                if (Sym(",") && Exp(exp)) {
+                    out.push_back(std::move(exp));
+                    continue;
+                }
+                m_Pos = save;
+                break;
+            }
+            return true;
+        }
+
+        bool ExpListLow(std::vector<Node>& out) {
+            Node exp;
+            if (!Exp(exp)) return false;
+            out.push_back(std::move(exp));
+            while (true) {
+                size_t save = m_Pos;
+                if ((Sym(",") || Sym(";")) && Exp(exp)) {
+                    out.push_back(std::move(exp));
+                    continue;
+                }
+                m_Pos = save;
+                break;
+            }
+            return true;
+        }
+
+        // Expressions
+
+        bool BinaryOperator(std::string_view& out) {
+            static constexpr std::string_view words[] = {"or", "and"};
+            static constexpr std::string_view symbols[] = {"<=", ">=", "~=", "!=", "==", ".."};
+            size_t start = m_Pos;
+            Space();
+
+            std::string_view op;
+            for (auto word : words) {
+                if (LookLit(word) && !IsAlphaNum(Peek(word.size()))) {
+                    op = word;
+                    break;
+                }
+            }
+            for (auto symbol : symbols) {
+                if (op.empty() && LookLit(symbol)) op = symbol;
+            }
+            // Bitwise operators are not present in every moonscript version
+            if (op.empty() && (LookLit("<<") || LookLit(">>") || LookLit("//") || Peek() == '|' || Peek() == '&'))
+                throw Unsupported();
+            if (op.empty()) {
+                switch (Peek()) {
+                    case '+': case '-': case '*': case '/': case '%': case '^': case '>': case '<':
+                        op = m_Src.substr(m_Pos, 1);
+                        break;
+                    default:
+                        m_Pos = start;
+                        return false;
+                }
+            }
+            m_Pos += op.size();
+            SpaceBreaks();
+            out = op;
+            return true;
+        }
+
+        bool Exp(Node& out) {
+            DepthGuard guard(*this);
+            Node value;
+            if (!Value(value)) return false;
+            Node exp = Wrap(std::move(value));
+            while (true) {
+                size_t save = m_Pos;
+                std::string_view op;
+                if (BinaryOperator(op) && Value(value)) {
+                    exp.items.push_back(Str(op));
+                    exp.items.push_back(std::move(value));
+                    continue;
+                }
+                m_Pos = save;
+                break;
+            }
+            out = Flatten("exp", std::move(exp));
+            return true;
+        }
+
+        bool Value(Node& out) {
+            size_t start = m_Pos;
+            Node value;
+            if (!(SimpleValue(value) || KeyValueTable(value) || ChainValue(value) || String(value)))
+                return false;
+            SetPos(value, start);
+            out = std::move(value);
+            return true;
+        }
+
+        bool SimpleValue(Node& out) {
+            if (If("if", out) || If("unless", out) || Switch(out) || With(out) || ClassDecl(out)
+                || ForEach(out) || For(out) || While(out))
+                return true;
+
+            size_t start = m_Pos;
+            Node node;
+            if (Do(node)) {
+                if (CheckDo()) {
+                    out = std::move(node);
+                    return true;
+                }
+                m_Pos = start;
+            }
+            if (Sym("-")) {
+                if (!LookSomeSpace() && Exp(node)) {
+                    out = Mark("minus", std::move(node));
+                    return true;
+                }
+                m_Pos = start;
+            }
+            if (Sym("#")) {
+                if (Exp(node)) {
+                    out = Mark("length", std::move(node));
+                    return true;
+                }
+                m_Pos = start;
+            }
+            // Bitwise not is not present in every moonscript version
+            Space();
+            if (Peek() == '~' && Peek(1) != '=') throw Unsupported();
+            m_Pos = start;
+            if (Key("not")) {
+                if (Exp(node)) {
+                    out = Mark("not", std::move(node));
+                    return true;
+                }
+                m_Pos = start;
+            }
+            return TblComprehension(out) || TableLit(out) || Comprehension(out) || FunLit(out) || Number(out);
+        }
+
+        bool Number(Node& out) {
+            size_t start = m_Pos;
+            Space();
+            size_t begin = m_Pos;
+            if (!NumberLiteral()) {
+                m_Pos = start;
+                return false;
+            }
+            // Int64 suffixes and other exotic forms depend on moonscript version
+            if (IsAlphaNum(Peek())) throw Unsupported();
+            out = Mark("number", Str(Slice(begin)));
+            return true;
+        }
+
+        // Strings
+
+        bool StringChar(char delim) {
+            if (Peek() == '\\' && (Peek(1) == delim || Peek(1) == '\\')) {
+                m_Pos += 2;
+                return true;
+            }
+            if (Eof() || Peek() == delim) return false;
+            m_Pos++;
+            return true;
+        }
+
+        bool Interpolation(Node& out) {
+            size_t start = m_Pos;
+            if (!Lit("#{")) return false;
+            Node exp;
+            if (Exp(exp) && Sym("}")) {
+                out = std::move(exp);
+                return true;
+            }
+            m_Pos = start;
+            return false;
+        }
+
+        // -interp predicate, it still parses whole expression like LPeg does
+        bool LookInterpolation() {
+            if (!LookLit("#{")) return false;
+            size_t start = m_Pos;
+            Node exp;
+            bool matched = Interpolation(exp);
+            m_Pos = start;
+            return matched;
+        }
+
+        bool SingleString(Node& out) {
+            size_t start = m_Pos;
+            if (Peek() != '\'') return false;
+            m_Pos++;
+            size_t begin = m_Pos;
+            while (StringChar('\'')) {}
+            Node str = Mark("string", Str("'"), Str(Slice(begin)));
+            Space();
+            if (Peek() != '\'') {
+                m_Pos = start;
+                return false;
+            }
+            m_Pos++;
+            out = std::move(str);
+            return true;
+        }
+
+        bool DoubleString(Node& out) {
+            size_t start = m_Pos;
+            if (Peek() != '"') return false;
+            m_Pos++;
+            Node str = Mark("string", Str("\""));
+            while (true) {
+                size_t begin = m_Pos;
+                while (!LookInterpolation() && StringChar('"')) {}
+                if (m_Pos > begin) {
+                    str.items.push_back(Str(Slice(begin)));
+                    continue;
+                }
+                Node exp;
+                if (Interpolation(exp)) {
+                    str.items.push_back(Mark("interpolate", std::move(exp)));
+                    continue;
+                }
+                break;
+            }
+            Space();
+            if (Peek() != '"') {
+                m_Pos = start;
+                return false;
+            }
+            m_Pos++;
+            out = std::move(str);
+            return true;
+        }
+
+        bool LookLuaStringClose(size_t level) const {
+            if (Peek() != ']') return false;
+            size_t count = 0;
+            while (Peek(1 + count) == '=') count++;
+            return Peek(1 + count) == ']' && count == level;
+        }
+
+        bool LuaString(Node& out) {
+            size_t start = m_Pos;
+            Space();
+            size_t open_begin = m_Pos;
+            if (!Lit("[")) {
+                m_Pos = start;
+                return false;
+            }
+            size_t level = 0;
+            while (Peek() == '=') {
+                m_Pos++;
+                level++;
+            }
+            if (!Lit("[")) {
+                m_Pos = start;
+                return false;
+            }
+            std::string_view open = Slice(open_begin);
+            Break();
+            size_t begin = m_Pos;
+            while (!Eof() && !LookLuaStringClose(level)) m_Pos++;
+            if (Eof()) {
+                m_Pos = start;
+                return false;
+            }
+            std::string_view content = Slice(begin);
+            m_Pos += level + 2;
+            out = Mark("string", Str(open), Str(content));
+            return true;
+        }
+
+        bool String(Node& out) {
+            size_t start = m_Pos;
+            Space();
+            if (DoubleString(out) || SingleString(out)) return true;
+            m_Pos = start;
+            return LuaString(out);
+        }
+
+        // Chains and calls
+
+        bool SelfName(Node& out) {
+            size_t start = m_Pos;
+            Space();
+            if (!Lit("@")) {
+                m_Pos = start;
+                return false;
+            }
+            std::string_view name;
+            if (Lit("@")) {
+                if (RawName(name)) out = Mark("self_class", Str(name));
+                else out = Str("self.__class");
+            } else if (RawName(name)) {
+                out = Mark("self", Str(name));
+            } else {
+                out = Str("self");
+            }
+            return true;
+        }
+
+        bool KeyName(Node& out) {
+            if (SelfName(out)) return true;
+            size_t start = m_Pos;
+            Space();
+            std::string_view name;
+            if (RawName(name)) {
+                out = Mark("key_literal", Str(name));
+                return true;
+            }
+            m_Pos = start;
+            return false;
+        }
+
+        bool Parens(Node& out) {
+            size_t start = m_Pos;
+            if (!Sym("(")) return false;
+            SpaceBreaks();
+            Node exp;
+            if (Exp(exp)) {
+                SpaceBreaks();
+                if (Sym(")")) {
+                    out = std::move(exp);
+                    return true;
+                }
+            }
+            m_Pos = start;
+            return false;
+        }
+
+        bool Callable(Node& out) {
+            size_t start = m_Pos;
+            std::string_view name;
+            if (Name(name)) {
+                out = Mark("ref", Str(name));
+                SetPos(out, start);
+                return true;
+            }
+            if (SelfName(out)) return true;
+            if (VarArg()) {
+                out = Str("...");
+                return true;
+            }
+            Node exp;
+            if (Parens(exp)) {
+                out = Mark("parens", std::move(exp));
+                return true;
+            }
+            return false;
+        }
+
+        bool FnArgsExpList(std::vector<Node>& out) {
+            Node exp;
+            if (!Exp(exp)) return false;
+            out.push_back(std::move(exp));
+            while (true) {
+                size_t save = m_Pos;
+                if (Break() || Sym(",")) {
+                    White();
+                    if (Exp(exp)) {
+                        out.push_back(std::move(exp));
+                        continue;
+                    }
+                }
+                m_Pos = save;
+                break;
+            }
+            return true;
+        }
+
+        bool FnArgs(Node& out) {
+            size_t start = m_Pos;
+            if (Lit("(")) {
+                SpaceBreaks();
+                Node args = Tbl();
+                FnArgsExpList(args.items);
+                SpaceBreaks();
+                if (Sym(")")) {
+                    out = std::move(args);
+                    return true;
+                }
+                m_Pos = start;
+            }
+            if (Sym("!")) {
+                if (Peek() != '=') {
+                    out = Tbl();
+                    return true;
+                }
+                m_Pos = start;
+            }
+            return false;
+        }
+
+        bool Invoke(Node& out) {
+            Node args;
+            if (FnArgs(args)) {
+                out = Mark("call", std::move(args));
+                return true;
+            }
+            Node str;
+            if (SingleString(str) || DoubleString(str) || (Peek() == '[' && LuaString(str))) {
+                out = Mark("call", Wrap(std::move(str)));
+                return true;
+            }
+            return false;
+        }
+
+        bool DotChainItem(Node& out) {
+            size_t start = m_Pos;
+            std::string_view name;
+            if (Lit(".") && RawName(name)) {
+                out = Mark("dot", Str(name));
+                return true;
+            }
+            m_Pos = start;
+            return false;
+        }
+
+        bool ColonChainItem(Node& out) {
+            size_t start = m_Pos;
+            std::string_view name;
+            if (Lit("\\") && RawName(name)) {
+                out = Mark("colon", Str(name));
+                return true;
+            }
+            m_Pos = start;
+            return false;
+        }
+
+        bool SliceItem(Node& out) {
+            size_t start = m_Pos;
+            if (!Lit("[")) return false;
+            Node slice = Mark("slice");
+            Node exp;
+            slice.items.push_back(Exp(exp) ? std::move(exp) : Num(1));
+            if (Sym(",")) {
+                slice.items.push_back(Exp(exp) ? std::move(exp) : Str(""));
+                size_t save = m_Pos;
+                if (Sym(",") && Exp(exp)) slice.items.push_back(std::move(exp));
+                else m_Pos = save;
+                if (Sym("]")) {
+                    out = std::move(slice);
+                    return true;
+                }
+            }
+            m_Pos = start;
+            return false;
+        }
+
+        bool ChainItem(Node& out) {
+            if (Invoke(out) || DotChainItem(out) || SliceItem(out)) return true;
+            size_t start = m_Pos;
+            if (Lit("[")) {
+                Node exp;
+                if (Exp(exp) && Sym("]")) {
+                    out = Mark("index", std::move(exp));
+                    return true;
+                }
+                m_Pos = start;
+            }
+            return false;
+        }
+
+        bool ColonChain(std::vector<Node>& out) {
+            Node item;
+            if (!ColonChainItem(item)) return false;
+            out.push_back(std::move(item));
+            if (Invoke(item)) {
+                out.push_back(std::move(item));
+                ChainItems(out);
+            }
+            return true;
+        }
+
+        bool ChainItems(std::vector<Node>& out) {
+            Node item;
+            if (!ChainItem(item)) return ColonChain(out);
+            out.push_back(std::move(item));
+            while (ChainItem(item)) out.push_back(std::move(item));
+            ColonChain(out);
+            return true;
+        }
+
+        bool Chain(Node& out) {
+            size_t start = m_Pos;
+            Node chain = Mark("chain");
+            Node callee;
+            bool head = false;
+            if (Callable(callee) || String(callee)) {
+                chain.items.push_back(std::move(callee));
+                head = true;
+            } else {
+                head = Peek() != '.' && Peek() != '\\';
+            }
+            if (head && ChainItems(chain.items)) {
+                out = std::move(chain);
+                return true;
+            }
+            m_Pos = start;
+
+            chain = Mark("chain");
+            Space();
+            Node item;
+            if (DotChainItem(item)) {
+                chain.items.push_back(std::move(item));
+                ChainItems(chain.items);
+            } else if (!ColonChain(chain.items)) {
+                m_Pos = start;
+                return false;
+            }
+            out = std::move(chain);
+            return true;
+        }
+
+        bool ChainValue(Node& out) {
+            Node callee;
+            if (!(Chain(callee) || Callable(callee))) return false;
+            Node args = Tbl();
+            InvokeArgs(args.items);
+            if (args.items.empty()) {
+                out = std::move(callee);
+            } else if (NodeType(callee) == "chain") {
+                callee.items.push_back(Mark("call", std::move(args)));
+                out = std::move(callee);
+            } else {
+                out = Mark("chain", std::move(callee), Mark("call", std::move(args)));
+            }
+            return true;
+        }
+
+        bool ArgBlock(std::vector<Node>& out) {
+            size_t start = m_Pos;
+            if (!(CheckIndent() && ExpList(out))) {
+                m_Pos = start;
+                return false;
+            }
+            while (true) {
+                size_t save = m_Pos;
+                if (Sym(",") && SpaceBreak() && CheckIndent() && ExpList(out)) continue;
+                m_Pos = save;
+                break;
+            }
+            PopIndent();
+            return true;
+        }
+
+        bool InvokeArgs(std::vector<Node>& out) {
+            if (Peek() == '-') return false;
+            Node block;
+            if (!ExpList(out)) {
+                if (!TableBlock(block)) return false;
+                out.push_back(std::move(block));
+                return true;
+            }
+
+            size_t save = m_Pos;
+            size_t count = out.size();
+            if (Sym(",")) {
+                if (TableBlock(block)) {
+                    out.push_back(std::move(block));
+                    return true;
+                }
+                if (SpaceBreak() && Advance() && ArgBlock(out)) {
+                    if (TableBlock(block)) out.push_back(std::move(block));
+                    return true;
+                }
+                m_Pos = save;
+                out.resize(count);
+            }
+            if (TableBlock(block)) out.push_back(std::move(block));
+            return true;
+        }
+
+        // Tables
+
+        bool KeyValue(Node& out) {
+            size_t start = m_Pos;
+            std::string_view name;
+            if (Sym(":")) {
+                if (!LookSomeSpace() && Name(name)) {
+                    Node ref = Mark("ref", Str(name));
+                    SetPos(ref, m_Pos);
+                    Node pair = Wrap(Mark("key_literal", Str(name)));
+                    pair.items.push_back(std::move(ref));
+                    out = std::move(pair);
+                    return true;
+                }
+                m_Pos = start;
+            }
+
+            Node key;
+            bool matched = KeyName(key);
+            if (!matched && Sym("[")) {
+                if (Exp(key) && Sym("]")) matched = true;
+                else m_Pos = start;
+            }
+            if (!matched) {
+                Space();
+                if (DoubleString(key) || SingleString(key)) matched = true;
+                else m_Pos = start;
+            }
+            if (!matched || !Lit(":")) {
+                m_Pos = start;
+                return false;
+            }
+
+            Node value;
+            if (!(Exp(value) || TableBlock(value))) {
+                if (!SpaceBreak()) {
+                    m_Pos = start;
+                    return false;
+                }
+                SpaceBreaks();
+                if (!Exp(value)) {
+                    m_Pos = start;
+                    return false;
+                }
+            }
+            Node pair = Wrap(std::move(key));
+            pair.items.push_back(std::move(value));
+            out = std::move(pair);
+            return true;
+        }
+
+        bool KeyValueList(std::vector<Node>& out) {
+            Node pair;
+            if (!KeyValue(pair)) return false;
+            out.push_back(std::move(pair));
+            while (true) {
+                size_t save = m_Pos;
+                if (Sym(",") && KeyValue(pair)) {
+                    out.push_back(std::move(pair));
+                    continue;
+                }
+                m_Pos = save;
+                break;
+            }
+            return true;
+        }
+
+        // Ct(KeyValueList) / mark"table"
+        bool KeyValueTable(Node& out) {
+            Node pairs = Tbl();
+            if (!KeyValueList(pairs.items)) return false;
+            out = Mark("table", std::move(pairs));
+            return true;
+        }
+
+        bool KeyValueLine(std::vector<Node>& out) {
+            size_t start = m_Pos;
+            if (!CheckIndent()) return false;
+            if (!KeyValueList(out)) {
+                m_Pos = start;
+                return false;
+            }
+            Sym(",");
+            return true;
+        }
+
+        bool TableValue(Node& out) {
+            if (KeyValue(out)) return true;
+            Node exp;
+            if (!Exp(exp)) return false;
+            out = Wrap(std::move(exp));
+            return true;
+        }
+
+        bool TableValueList(std::vector<Node>& out) {
+            Node value;
+            if (!TableValue(value)) return false;
+            out.push_back(std::move(value));
+            while (true) {
+                size_t save = m_Pos;
+                if (Sym(",") && TableValue(value)) {
+                    out.push_back(std::move(value));
+                    continue;
+                }
+                m_Pos = save;
+                break;
+            }
+            return true;
+        }
+
+        // PushIndent * ((TableValueList * PopIndent) + (PopIndent * Cut)) + Space
+        void TableLitLine(std::vector<Node>& out) {
+            size_t start = m_Pos;
+            PushIndent();
+            if (TableValueList(out)) {
+                PopIndent();
+                return;
+            }
+            PopIndent();
+            m_Pos = start;
+            Space();
+        }
+
+        bool TableLit(Node& out) {
+            size_t start = m_Pos;
+            if (!Sym("{")) return false;
+            Node values = Tbl();
+            TableValueList(values.items);
+            Sym(",");
+
+            size_t save = m_Pos;
+            if (SpaceBreak()) {
+                TableLitLine(values.items);
+                while (true) {
+                    size_t line = m_Pos;
+                    Sym(",");
+                    if (SpaceBreak()) {
+                        TableLitLine(values.items);
+                        continue;
+                    }
+                    m_Pos = line;
+                    break;
+                }
+                Sym(",");
+            } else {
+                m_Pos = save;
+            }
+
+            White();
+            if (!Sym("}")) {
+                m_Pos = start;
+                return false;
+            }
+            out = Mark("table", std::move(values));
+            return true;
+        }
+
+        bool TableBlock(Node& out) {
+            size_t start = m_Pos;
+            if (!SpaceBreak()) return false;
+            SpaceBreaks();
+            if (!Advance()) {
+                m_Pos = start;
+                return false;
+            }
+
+            Node pairs = Tbl();
+            bool matched = KeyValueLine(pairs.items);
+            while (matched) {
+                size_t save = m_Pos;
+                if (SpaceBreak()) {
+                    SpaceBreaks();
+                    if (KeyValueLine(pairs.items)) continue;
+                }
+                m_Pos = save;
+                break;
+            }
+            PopIndent();
+            if (!matched) {
+                m_Pos = start;
+                return false;
+            }
+            out = Mark("table", std::move(pairs));
+            return true;
+        }
+
+        // Classes and functions
+
+        bool Assignable(Node& out) {
+            size_t start = m_Pos;
+            Node chain;
+            if (Chain(chain)) {
+                if (IsAssignable(chain)) {
+                    out = std::move(chain);
+                    return true;
+                }
+                m_Pos = start;
+            }
+            std::string_view name;
+            if (Name(name)) {
+                out = Str(name);
+                return true;
+            }
+            return SelfName(out);
+        }
+
+        bool ClassLine(std::vector<Node>& out) {
+            size_t start = m_Pos;
+            if (!CheckIndent()) return false;
+            Node line = Mark("props");
+            Node stm;
+            if (KeyValueList(line.items)) {
+                // props
+            } else if (Statement(stm) || Exp(stm)) {
+                line = Mark("stm", std::move(stm));
+            } else {
+                m_Pos = start;
+                return false;
+            }
+            Sym(",");
+            out.push_back(std::move(line));
+            return true;
+        }
+
+        bool ClassBlock(Node& out) {
+            size_t start = m_Pos;
+            if (!SpaceBreak()) return false;
+            SpaceBreaks();
+            if (!Advance()) {
+                m_Pos = start;
+                return false;
+            }
+            Node lines = Tbl();
+            if (!ClassLine(lines.items)) {
+                m_Pos = start;
+                return false;
+            }
+            while (true) {
+                size_t save = m_Pos;
+                if (SpaceBreak()) {
+                    SpaceBreaks();
+                    if (ClassLine(lines.items)) continue;
+                }
+                m_Pos = save;
+                break;
+            }
+            PopIndent();
+            out = std::move(lines);
+            return true;
+        }
+
+        bool ClassDecl(Node& out) {
+            size_t start = m_Pos;
+            if (!Key("class")) return false;
+            if (Peek() == ':') {
+                m_Pos = start;
+                return false;
+            }
+
+            Node name; // nil if class is anonymous
+            Assignable(name);
+
+            Node parent = Str("");
+            size_t save = m_Pos;
+            if (Key("extends")) {
+                PreventIndent();
+                Node exp;
+                if (Exp(exp)) {
+                    PopIndent();
+                    parent = std::move(exp);
+                } else {
+                    PopIndent();
+                    m_Pos = save;
+                }
+            }
+
+            Node body;
+            if (!ClassBlock(body)) body = Tbl();
+            out = Mark("class", std::move(name), std::move(parent), std::move(body));
+            return true;
+        }
+
+        bool FnArgDef(Node& out) {
+            Node arg = Tbl();
+            std::string_view name;
+            Node self;
+            if (Name(name)) arg.items.push_back(Str(name));
+            else if (SelfName(self)) arg.items.push_back(std::move(self));
+            else return false;
+
+            size_t save = m_Pos;
+            Node value;
+            if (Sym("=") && Exp(value)) arg.items.push_back(std::move(value));
+            else m_Pos = save;
+            out = std::move(arg);
+            return true;
+        }
+
+        bool FnArgSeparator() {
+            if (!(Sym(",") || Break())) return false;
+            White();
+            return true;
+        }
+
+        bool FnArgDefList(std::vector<Node>& out) {
+            Node arg;
+            if (!FnArgDef(arg)) {
+                if (!VarArg()) return false;
+                out.push_back(Wrap(Str("...")));
+                return true;
+            }
+            out.push_back(std::move(arg));
+            while (true) {
+                size_t save = m_Pos;
+                if (FnArgSeparator() && FnArgDef(arg)) {
+                    out.push_back(std::move(arg));
+                    continue;
+                }
+                m_Pos = save;
+                break;
+            }
+            while (true) {
+                size_t save = m_Pos;
+                if (FnArgSeparator() && VarArg()) {
+                    out.push_back(Wrap(Str("...")));
+                    continue;
+                }
+                m_Pos = save;
+                break;
+            }
+            return true;
+        }
+
+        void FnArgsDef(Node& args, Node& uses) {
+            size_t start = m_Pos;
+            args = Tbl();
+            uses = Tbl();
+            if (!Sym("(")) return;
+
+            White();
+            FnArgDefList(args.items);
+            size_t save = m_Pos;
+            bool matched = false;
+            if (Key("using")) {
+                if (NameList(uses.items)) {
+                    matched = true;
+                } else {
+                    Space();
+                    matched = Lit("nil");
+                }
+            }
+            if (!matched) m_Pos = save;
+
+            White();
+            if (Sym(")")) return;
+            m_Pos = start;
+            args = Tbl();
+            uses = Tbl();
+        }
+
+        bool FunLit(Node& out) {
+            size_t start = m_Pos;
+            Node args, uses;
+            FnArgsDef(args, uses);
+            std::string_view arrow;
+            if (Sym("->")) arrow = "slim";
+            else if (Sym("=>")) arrow = "fat";
+            else {
+                m_Pos = start;
+                return false;
+            }
+            Node body;
+            if (!Body(body)) body = Tbl();
+            out = Mark("fndef", std::move(args), std::move(uses), Str(arrow), std::move(body));
+            return true;
+        }
+
+    public:
+        explicit Parser(std::string_view src) : m_Src(src) {}
+
+        bool File(Node& out) {
+            White();
+            Shebang();
+            if (!Block(out)) out = Tbl();
+            White();
+            return Eof();
+        }
+    };
+
+    bool PushNode(lua_State* L, const Node& node) {
+        if (!lua_checkstack(L, 2)) return false;
+        switch (node.type) {
+            case Node::Nil: lua_pushnil(L); return true;
+            case Node::String: lua_pushlstring(L, node.str.data(), node.str.size()); return true;
+            case Node::Number: lua_pushinteger(L, node.number); return true;
+            case Node::Table: break;
+        }
+
+        lua_createtable(L, static_cast<int>(node.items.size()), node.pos != 0 ? 1 : 0);
+        for (size_t i = 0; i < node.items.size(); i++) {
+            // Holes (e.g. name of anonymous class) are left as is, just like table constructor does
+            if (node.items[i].type == Node::Nil) continue;
+            if (!PushNode(L, node.items[i])) return false;
+            lua_rawseti(L, -2, static_cast<int>(i) + 1);
+        }
+        if (node.pos != 0) {
+            lua_pushinteger(L, node.pos);
+            lua_rawseti(L, -2, -1);
+        }
+        return true;
+    }
+
+    std::string KeyToString(lua_State* L, int idx) {
+        lua_pushvalue(L, idx);
+        size_t len = 0;
+        const char* str = lua_tolstring(L, -1, &len);
+        std::string result = str ? std::string(str, len) : luaL_typename(L, -1);
+        lua_pop(L, 1);
+        return result;
+    }
+}
+
+bool MoonEngine::NativeParse(lua_State* L, std::string_view code) {
+    Node tree;
+    try {
+        Parser parser(code);
+        if (!parser.File(tree)) return false;
+    } catch (const Unsupported&) {
+        return false;
+    }
+
+    int top = lua_gettop(L);
+    if (!PushNode(L, tree)) {
+        lua_settop(L, top);
+        return false;
+    }
+    return true;
+}
+
+bool MoonEngine::CompareTrees(lua_State* L, int a, int b, std::string& path) {
+    a = lua_absindex(L, a);
+    b = lua_absindex(L, b);
+    if (!lua_istable(L, a) || !lua_istable(L, b)) {
+        if (lua_type(L, a) == lua_type(L, b) && lua_rawequal(L, a, b)) return true;
+        path += ": " + KeyToString(L, a) + " ~= " + KeyToString(L, b);
+        return false;
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, a) != 0) {
+        lua_pushvalue(L, -2);
+        lua_rawget(L, b);
+        std::string key = "[" + KeyToString(L, -3) + "]";
+        std::string subpath;
+        if (!CompareTrees(L, -2, -1, subpath)) {
+            path += key + subpath;
+            lua_pop(L, 3);
+            return false;
+        }
+        lua_pop(L, 2);
+    }
+
+    // Keys missing in first tree
+    lua_pushnil(L);
+    while (lua_next(L, b) != 0) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_rawget(L, a);
+        bool missing = lua_isnil(L, -1);
+        lua_pop(L, 1);
+        if (missing) {
+            path += "[" + KeyToString(L, -1) + "]: missing";
+            lua_pop(L, 1);
+            return false;
+        }
+    }
+    return true;
+}
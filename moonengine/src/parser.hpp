@@ -0,0 +1,23 @@
+#ifndef MOONENGINE_PARSER_HPP
+#define MOONENGINE_PARSER_HPP
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+struct lua_State;
+
+namespace MoonEngine {
+    // Native port of moonscript.parse grammar.
+    // Pushes the same tree moonscript.parse.string would return and returns true,
+    // or pushes nothing and returns false if source has syntax errors or uses something
+    // parser can't reproduce exactly. LPeg grammar should be used then, it also reports proper errors.
+    bool NativeParse(lua_State* L, std::string_view code);
+
+    // Deep compares two parse trees at given stack indices,
+    // on mismatch returns false and writes path to the first different value
+    bool CompareTrees(lua_State* L, int a, int b, std::string& path);
+}
+
+#endif // MOONENGINE_PARSER_HPP
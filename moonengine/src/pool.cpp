@@ -0,0 +1,139 @@
+#include "moonengine/pool.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+
+using namespace MoonEngine;
+
+EnginePool::EnginePool(size_t size, const GCPolicy& policy) : m_GCPolicy(policy) {
+    if (size == 0) size = std::max(std::thread::hardware_concurrency(), 1u);
+
+    // Engines are created on their own threads, so all of them are warmed up in parallel
+    std::vector<std::future<void>> ready;
+    m_EngineTasks.resize(size);
+    for (size_t i = 0; i < size; i++) {
+        std::promise<void> promise;
+        ready.push_back(promise.get_future());
+        m_Workers.emplace_back(&EnginePool::WorkerMain, this, i, std::move(promise));
+    }
+
+    try {
+        for (auto& engine_ready : ready)
+            engine_ready.get();
+    } catch (...) {
+        Stop();
+        throw;
+    }
+}
+
+EnginePool::~EnginePool() {
+    Stop();
+}
+
+void EnginePool::Stop() {
+    {
+        std::lock_guard<std::mutex> guard(m_Lock);
+        m_Stopping = true;
+    }
+    m_Condition.notify_all();
+
+    for (auto& worker : m_Workers)
+        if (worker.joinable()) worker.join();
+}
+
+void EnginePool::WorkerMain(size_t index, std::promise<void> ready) {
+    std::unique_ptr<Engine> engine;
+    try {
+        engine = std::make_unique<Engine>(m_GCPolicy);
+        ready.set_value();
+    } catch (...) {
+        ready.set_exception(std::current_exception());
+        return;
+    }
+
+    while (true) {
+        std::function<void(Engine&)> task;
+        {
+            std::unique_lock<std::mutex> lock(m_Lock);
+            auto& own_tasks = m_EngineTasks[index];
+            if (m_Tasks.empty() && own_tasks.empty() && !m_Stopping && engine->NeedsRecycle()) {
+                // Nobody waits for us, good time to rebuild fragmented engine
+                lock.unlock();
+                engine->Recycle();
+                lock.lock();
+            }
+            m_Condition.wait(lock, [&] { return m_Stopping || !m_Tasks.empty() || !own_tasks.empty(); });
+
+            // Nobody else can run our own tasks, so they go first
+            auto& tasks = own_tasks.empty() ? m_Tasks : own_tasks;
+            if (tasks.empty()) return; // Stopping and nothing left to do
+
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task(*engine);
+    }
+}
+
+void EnginePool::Post(std::function<void(Engine&)> task) {
+    {
+        std::lock_guard<std::mutex> guard(m_Lock);
+        if (m_Stopping) throw std::runtime_error("engine pool is stopped");
+        m_Tasks.push_back(std::move(task));
+    }
+    m_Condition.notify_one();
+}
+
+void EnginePool::PostTo(size_t index, std::function<void(Engine&)> task) {
+    {
+        std::lock_guard<std::mutex> guard(m_Lock);
+        if (m_Stopping) throw std::runtime_error("engine pool is stopped");
+        m_EngineTasks[index].push_back(std::move(task));
+    }
+    // Only one worker can take it, and we don't know which one would be woken up
+    m_Condition.notify_all();
+}
+
+std::future<CompileInfo> EnginePool::Submit(std::string moonCode, CompileOptions options) {
+    return Run([moonCode = std::move(moonCode), options](Engine& engine) {
+        return engine.CompileString2(moonCode, options);
+    });
+}
+
+CompileInfo EnginePool::Compile(std::string_view moonCode, const CompileOptions& options) {
+    return Run([moonCode, &options](Engine& engine) {
+        return engine.CompileString2(moonCode, options);
+    }).get();
+}
+
+std::vector<CompileInfo> EnginePool::CompileBatch(const std::vector<std::string_view>& moonCodes, const CompileOptions& options) {
+    std::vector<CompileInfo> results(moonCodes.size());
+    if (moonCodes.empty()) return results;
+
+    // Contiguous slices with roughly the same amount of source, one per engine
+    size_t total = 0;
+    for (auto code : moonCodes) total += code.size();
+    size_t slices = std::min(Size(), moonCodes.size());
+    size_t target = total / slices + 1;
+
+    // Slices write into results, so all posted ones must be finished before we leave, even on errors
+    std::vector<std::future<void>> pending;
+    std::shared_ptr<void> _(nullptr, [&pending](...) {
+        for (auto& slice : pending) if (slice.valid()) slice.wait();
+    });
+
+    size_t begin = 0;
+    while (begin < moonCodes.size()) {
+        size_t end = begin, bytes = 0;
+        bool last = pending.size() + 1 == slices;
+        while (end < moonCodes.size() && (last || end == begin || bytes + moonCodes[end].size() <= target))
+            bytes += moonCodes[end++].size();
+
+        pending.push_back(Run([&, begin, end](Engine& engine) {
+            engine.CompileBatch(moonCodes.data() + begin, end - begin, results.data() + begin, options);
+        }));
+        begin = end;
+    }
+    for (auto& slice : pending) slice.get();
+    return results;
+}
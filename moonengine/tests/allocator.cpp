@@ -0,0 +1,91 @@
+// Checks Used() accounting of engine allocator when lua reallocates blocks across size classes, used by ctest
+// Shrinking must not fail, so when no memory can be taken the old block is kept, and it must be accounted with the new size
+
+#include "allocator.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+
+using namespace MoonEngine;
+
+// Allocator is linked statically, so these replace the system functions it calls
+static bool g_FailSlabs = false;
+static bool g_FailRealloc = false;
+
+extern "C" int posix_memalign(void** ptr, size_t alignment, size_t size) {
+    if (g_FailSlabs) return ENOMEM;
+    *ptr = aligned_alloc(alignment, size);
+    return *ptr ? 0 : ENOMEM;
+}
+
+extern "C" void* realloc(void* ptr, size_t size) {
+    using realloc_t = void* (*)(void*, size_t);
+    static auto next = reinterpret_cast<realloc_t>(dlsym(RTLD_NEXT, "realloc"));
+    return g_FailRealloc ? nullptr : next(ptr, size);
+}
+
+static int g_Failures = 0;
+
+static void expect(bool ok, const char* what, const Allocator& allocator) {
+    if (ok) return;
+    fprintf(stderr, "FAIL: %s (used %zu, peak %zu)\n", what, allocator.Used(), allocator.Peak());
+    g_Failures++;
+}
+
+static void* realloc_block(Allocator& allocator, void* ptr, size_t osize, size_t nsize) {
+    void* result = Allocator::Alloc(&allocator, ptr, osize, nsize);
+    if (result && nsize > 0) memset(result, 0x5a, nsize); // Lua may write all of it
+    return result;
+}
+
+int main() {
+    Allocator allocator;
+
+    // Successful moves: between size classes, slab and malloc
+    void* block = realloc_block(allocator, nullptr, 0, 500);
+    expect(allocator.Used() == 500, "alloc small", allocator);
+    block = realloc_block(allocator, block, 500, 40);
+    expect(allocator.Used() == 40, "shrink to smaller size class", allocator);
+    block = realloc_block(allocator, block, 40, 3000);
+    expect(allocator.Used() == 3000, "grow from slab to malloc", allocator);
+    block = realloc_block(allocator, block, 3000, 100);
+    expect(allocator.Used() == 100, "shrink from malloc to slab", allocator);
+    realloc_block(allocator, block, 100, 0);
+    expect(allocator.Used() == 0, "free", allocator);
+
+    // Failed moves: no slab for the new size class can be taken
+    void* small = realloc_block(allocator, nullptr, 0, 500);
+    void* big = realloc_block(allocator, nullptr, 0, 4000);
+    void* bigger = realloc_block(allocator, nullptr, 0, 8000);
+    allocator.Trim(0); // No empty slabs to reuse
+    allocator.ResetPeak();
+    expect(allocator.Used() == 12500, "alloc before failures", allocator);
+
+    g_FailSlabs = g_FailRealloc = true;
+    void* kept = realloc_block(allocator, small, 500, 40);
+    expect(kept == small, "failed shrink to smaller size class keeps block", allocator);
+    expect(allocator.Used() == 12040, "failed shrink to smaller size class", allocator);
+    kept = realloc_block(allocator, big, 4000, 100);
+    expect(kept == big, "failed shrink from malloc to slab keeps block", allocator);
+    expect(allocator.Used() == 8140, "failed shrink from malloc to slab", allocator);
+    kept = realloc_block(allocator, bigger, 8000, 1000);
+    expect(kept == bigger, "failed realloc shrink keeps block", allocator);
+    expect(allocator.Used() == 1140, "failed realloc shrink", allocator);
+    expect(realloc_block(allocator, small, 40, 200) == nullptr, "growth fails", allocator);
+    expect(allocator.Used() == 1140, "failed growth", allocator);
+    expect(allocator.Peak() == 12500, "peak", allocator);
+    g_FailSlabs = g_FailRealloc = false;
+
+    // Lua frees blocks with sizes it was given
+    realloc_block(allocator, small, 40, 0);
+    realloc_block(allocator, big, 100, 0);
+    realloc_block(allocator, bigger, 1000, 0);
+    expect(allocator.Used() == 0, "free after failures", allocator);
+
+    if (g_Failures > 0) return 1;
+    printf("allocator accounting matches sizes owned by lua\n");
+    return 0;
+}
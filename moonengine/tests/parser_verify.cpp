@@ -0,0 +1,90 @@
+// Checks native parser against LPeg grammar (ParserMode::Verify), used by ctest
+// Usage: moonengine_parser_test <directory>...
+// Every .moon file of given directories must be parsed into the same tree by both parsers, with and without LPeg memoization.
+// Valid files must not fall back to LPeg grammar, since then nothing is compared. Files of "invalid" subdirectories must be rejected.
+
+#include <moonengine/engine.hpp>
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <filesystem>
+
+std::string ReadFile(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+}
+
+inline bool StartsWith(std::string_view str, std::string_view prefix) {
+    return str.rfind(prefix, 0) == 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <directory>...\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<std::filesystem::path> files;
+    for (int i = 1; i < argc; i++) {
+        for (const auto& entry : std::filesystem::recursive_directory_iterator(argv[i])) {
+            if (entry.is_regular_file() && entry.path().extension() == ".moon")
+                files.push_back(entry.path());
+        }
+    }
+    std::sort(files.begin(), files.end());
+    if (files.empty()) {
+        fprintf(stderr, "no .moon files found\n");
+        return 1;
+    }
+
+    MoonEngine::Engine engine;
+    MoonEngine::CompileOptions options;
+    options.parser = MoonEngine::ParserMode::Verify;
+
+    size_t failures = 0, native = 0, fallbacks = 0, rejected = 0;
+    MoonEngine::CompileInfo info;
+    for (const auto& path : files) {
+        auto code = ReadFile(path);
+        bool invalid = path.parent_path().filename() == "invalid";
+        for (bool memoize : {false, true}) {
+            options.memoize = memoize;
+            engine.CompileInto(code, info, options);
+
+            const char* mode = memoize ? "memo" : "plain";
+            if (info.error && StartsWith(info.error->msg, "native parser")) {
+                // Tree mismatch, or native parser accepted what LPeg grammar rejects
+                fprintf(stderr, "FAIL %s (%s): %s\n", path.string().c_str(), mode, info.error->msg.c_str());
+                failures++;
+            } else if (invalid != info.error.has_value()) {
+                fprintf(stderr, "FAIL %s (%s): %s\n", path.string().c_str(), mode,
+                    invalid ? "invalid source was compiled" : info.error->msg.c_str());
+                failures++;
+            } else if (invalid) {
+                rejected++;
+            } else if (info.native_parsed) {
+                native++;
+            } else {
+                // Native parser gave up and LPeg grammar was used, so there was nothing to compare
+                fprintf(stderr, "FAIL %s (%s): native parser fell back to LPeg grammar\n", path.string().c_str(), mode);
+                fallbacks++;
+                failures++;
+            }
+        }
+    }
+
+    if (native == 0) {
+        fprintf(stderr, "FAIL: native parser didn't parse any file\n");
+        failures++;
+    }
+
+    printf("%zu files, %zu native parses verified, %zu fallbacks to LPeg, %zu invalid sources rejected, %zu failures\n",
+        files.size(), native, fallbacks, rejected, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,33 @@
+// Creates an engine from embedded moonscript (bytecode when MOONENGINE_PRECOMPILE is on) and compiles a trivial file, used by ctest
+// Catches builds where moonscript modules load but don't work, e.g. bytecode without debug info breaks setfenv of moonscript.util
+
+#include <moonengine/engine.hpp>
+
+#include <cstdio>
+#include <exception>
+
+int main() {
+    try {
+        MoonEngine::Engine engine;
+        for (auto parser : {MoonEngine::ParserMode::LPeg, MoonEngine::ParserMode::Native}) {
+            MoonEngine::CompileOptions options;
+            options.parser = parser;
+            auto info = engine.CompileString2("greet = (name) -> print \"Hello, #{name}!\"\ngreet \"world\"\n", options);
+            const char* mode = parser == MoonEngine::ParserMode::LPeg ? "lpeg" : "native";
+            if (info.error) {
+                fprintf(stderr, "FAIL (%s): %s\n", mode, info.error->msg.c_str());
+                return 1;
+            }
+            if (info.lua_code.find("greet") == std::string::npos) {
+                fprintf(stderr, "FAIL (%s): unexpected output:\n%s\n", mode, info.lua_code.c_str());
+                return 1;
+            }
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "FAIL: engine couldn't be created: %s\n", e.what());
+        return 1;
+    }
+
+    printf("engine started and compiled with embedded moonscript\n");
+    return 0;
+}
@@ -0,0 +1,160 @@
+#include "compile_cache.hpp"
+#include "yuescript.hpp"
+
+#include <cstring>
+#include <yuescript/yue_compiler.h>
+
+using namespace MoonLoader;
+
+CompileCache::Entry CompileCache::Entry::FromMoonscript(MoonEngine::CompileInfo&& info) {
+    Entry entry;
+    entry.lua_code = std::move(info.lua_code);
+    entry.posmap = std::move(info.posmap);
+    return entry;
+}
+
+CompileCache::Entry CompileCache::Entry::FromYuescript(std::string&& lua_code) {
+    Entry entry;
+    // Yuescript only gives us source lines
+    auto lines = Yuescript::ParseLines(lua_code);
+    for (size_t lua_line = 1; lua_line < lines.size(); lua_line++) {
+        // Lines are ascending, so every insert goes to the end
+        if (lines[lua_line] > 0)
+            entry.posmap.emplace_hint(entry.posmap.end(), static_cast<int>(lua_line), MoonEngine::CompileInfo::Pos(0, lines[lua_line], 1));
+    }
+    entry.lua_code = std::move(lua_code);
+    return entry;
+}
+
+CompileCache& CompileCache::Get() {
+    static CompileCache cache;
+    return cache;
+}
+
+// MurmurHash64A by Austin Appleby, public domain
+uint64_t CompileCache::Hash(std::string_view data, uint64_t seed) {
+    constexpr uint64_t m = 0xc6a4a7935bd1e995ULL;
+    constexpr int r = 47;
+
+    uint64_t h = seed ^ (data.size() * m);
+
+    const char* ptr = data.data();
+    const char* end = ptr + (data.size() / 8) * 8;
+    for (; ptr != end; ptr += 8) {
+        uint64_t k;
+        std::memcpy(&k, ptr, sizeof(k));
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    switch (data.size() & 7) {
+        case 7: h ^= uint64_t(static_cast<unsigned char>(ptr[6])) << 48; [[fallthrough]];
+        case 6: h ^= uint64_t(static_cast<unsigned char>(ptr[5])) << 40; [[fallthrough]];
+        case 5: h ^= uint64_t(static_cast<unsigned char>(ptr[4])) << 32; [[fallthrough]];
+        case 4: h ^= uint64_t(static_cast<unsigned char>(ptr[3])) << 24; [[fallthrough]];
+        case 3: h ^= uint64_t(static_cast<unsigned char>(ptr[2])) << 16; [[fallthrough]];
+        case 2: h ^= uint64_t(static_cast<unsigned char>(ptr[1])) << 8; [[fallthrough]];
+        case 1: h ^= uint64_t(static_cast<unsigned char>(ptr[0]));
+                h *= m;
+    };
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+CompileCache::Key CompileCache::MoonscriptKey(std::string_view code, const MoonEngine::CompileOptions& options) {
+    std::string options_str;
+    options_str += options.implicitly_return_root ? '1' : '0';
+
+    Key key;
+    key.language = Language::Moonscript;
+    key.size = code.size();
+    key.hash = Hash(code, Hash(options_str));
+    return key;
+}
+
+CompileCache::Key CompileCache::YuescriptKey(std::string_view code, const yue::YueConfig& config, uint64_t imports_hash) {
+    std::string options_str;
+    options_str += config.lintGlobalVariable ? '1' : '0';
+    options_str += config.implicitReturnRoot ? '1' : '0';
+    options_str += config.reserveLineNumber ? '1' : '0';
+    options_str += config.reserveComment ? '1' : '0';
+    options_str += config.useSpaceOverTab ? '1' : '0';
+    options_str += std::to_string(config.lineOffset);
+    options_str += '\0';
+    options_str += config.module;
+    for (const auto& [key, value] : config.options) {
+        options_str += '\0';
+        options_str += key;
+        options_str += '=';
+        options_str += value;
+    }
+
+    Key key;
+    key.language = Language::Yuescript;
+    key.size = code.size();
+    key.hash = Hash(code, Hash(options_str, imports_hash));
+    return key;
+}
+
+std::shared_ptr<const CompileCache::Entry> CompileCache::Find(const Key& key) {
+    std::lock_guard<std::mutex> guard(m_Lock);
+    auto it = m_Index.find(key);
+    if (it == m_Index.end()) return nullptr;
+
+    // Move entry to the front, since it was used recently
+    m_Entries.splice(m_Entries.begin(), m_Entries, it->second);
+    return it->second->second;
+}
+
+std::shared_ptr<const CompileCache::Entry> CompileCache::Insert(const Key& key, Entry&& entry) {
+    auto ptr = std::make_shared<const Entry>(std::move(entry));
+
+    std::lock_guard<std::mutex> guard(m_Lock);
+    if (auto it = m_Index.find(key); it != m_Index.end()) {
+        m_Size -= it->second->second->Size();
+        m_Entries.erase(it->second);
+        m_Index.erase(it);
+    }
+
+    m_Entries.emplace_front(key, ptr);
+    m_Index.insert_or_assign(key, m_Entries.begin());
+    m_Size += ptr->Size();
+    Evict();
+
+    return ptr;
+}
+
+void CompileCache::Evict() {
+    while (m_Size > m_Budget && !m_Entries.empty()) {
+        auto& [key, entry] = m_Entries.back();
+        m_Size -= entry->Size();
+        m_Index.erase(key);
+        m_Entries.pop_back();
+    }
+}
+
+void CompileCache::SetBudget(size_t bytes) {
+    std::lock_guard<std::mutex> guard(m_Lock);
+    m_Budget = bytes;
+    Evict();
+}
+
+size_t CompileCache::GetSize() {
+    std::lock_guard<std::mutex> guard(m_Lock);
+    return m_Size;
+}
+
+void CompileCache::Clear() {
+    std::lock_guard<std::mutex> guard(m_Lock);
+    m_Entries.clear();
+    m_Index.clear();
+    m_Size = 0;
+}
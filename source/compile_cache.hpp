@@ -0,0 +1,89 @@
+#ifndef MOONLOADER_COMPILE_CACHE_HPP
+#define MOONLOADER_COMPILE_CACHE_HPP
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <moonengine/engine.hpp>
+
+namespace yue {
+    struct YueConfig;
+}
+
+namespace MoonLoader {
+    // Process-wide cache of compiled sources, shared by every Core and Lua API.
+    // Entries are addressed by the hash of the source code, its language and compile options.
+    class CompileCache {
+    public:
+        enum class Language {
+            Moonscript,
+            Yuescript
+        };
+
+        struct Key {
+            uint64_t hash = 0;
+            size_t size = 0;
+            Language language = Language::Moonscript;
+
+            bool operator==(const Key& other) const {
+                return hash == other.hash && size == other.size && language == other.language;
+            }
+        };
+
+        struct KeyHasher {
+            size_t operator()(const Key& key) const { return static_cast<size_t>(key.hash); }
+        };
+
+        struct Entry {
+            std::string lua_code;
+            std::map<int, MoonEngine::CompileInfo::Pos> posmap; // lua line -> source pos
+
+            // Approximate amount of memory used by entry
+            size_t Size() const {
+                return sizeof(Entry) + lua_code.capacity() + posmap.size() * (sizeof(int) + sizeof(MoonEngine::CompileInfo::Pos) + 32);
+            }
+
+            static Entry FromMoonscript(MoonEngine::CompileInfo&& info);
+            static Entry FromYuescript(std::string&& lua_code);
+        };
+
+        static constexpr size_t DEFAULT_BUDGET = 64 * 1024 * 1024; // 64MB
+
+    private:
+        typedef std::list<std::pair<Key, std::shared_ptr<const Entry>>> EntryList;
+
+        std::mutex m_Lock;
+        EntryList m_Entries; // Most recently used entries are at the front
+        std::unordered_map<Key, EntryList::iterator, KeyHasher> m_Index;
+        size_t m_Size = 0;
+        size_t m_Budget = DEFAULT_BUDGET;
+
+        // Removes least recently used entries until cache fits into the budget
+        void Evict();
+
+    public:
+        static CompileCache& Get();
+
+        static uint64_t Hash(std::string_view data, uint64_t seed = 0);
+        static Key MoonscriptKey(std::string_view code, const MoonEngine::CompileOptions& options = {});
+        // Output of code with macros depends on imported macro modules too, so their hash is a part of the key
+        static Key YuescriptKey(std::string_view code, const yue::YueConfig& config, uint64_t imports_hash = 0);
+
+        std::shared_ptr<const Entry> Find(const Key& key);
+        std::shared_ptr<const Entry> Insert(const Key& key, Entry&& entry);
+
+        // Zero budget disables cache
+        void SetBudget(size_t bytes);
+        size_t GetSize();
+        void Clear();
+    };
+}
+
+#endif // MOONLOADER_COMPILE_CACHE_HPP
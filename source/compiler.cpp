@@ -3,90 +3,507 @@
 #include "filesystem.hpp"
 #include "utils.hpp"
 #include "core.hpp"
+#include "compile_cache.hpp"
+#include "yuescript.hpp"
+#include "manifest.hpp"
 
 #include <tier1/utlbuffer.h>
 #include <filesystem.h>
-#include <moonengine/engine.hpp>
+#include <moonengine/pool.hpp>
 #include <yuescript/yue_compiler.h>
 #include <GarrysMod/Lua/LuaInterface.h>
-#include <regex>
-
-void yue_openlibs(void* state);
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
 
 using namespace MoonLoader;
 
-std::map<int, int> ParseYueLines(std::string_view code) {
-    static std::regex YUE_LINE_REGEX("--\\s*(\\d*)\\s*$", std::regex_constants::optimize);
-
-    std::map<int, int> line_map;
-    Utils::Split(code, [&](std::string_view line, size_t num) {
-        std::cmatch match;
-        if (std::regex_search(line.data(), line.data() + line.size(), match, YUE_LINE_REGEX)) {
-            int source_line = std::stoi(match[1].str());
-            line_map[num] = source_line;
-        }
-    });
-    return line_map;
-}
-
 bool Compiler::NeedsCompile(const std::string& path) {
     auto it = compiled_files.find(path);
     if (it == compiled_files.end()) return true;
 
+    // Watched files are marked dirty by watchdog, so there is no need to ask filesystem
+    if (it->second.watched && Core::cvar_watch_freshness.GetBool())
+        return watchdog->IsFileDirty(path);
+
     auto update_date = fs->GetFileTime(path, core->LUA->GetPathID());
     return update_date > it->second.update_date;
 }
 
-bool Compiler::CompileFile(const std::string& path, bool force) {
-    if (!force && !NeedsCompile(path)) return true;
+size_t Compiler::LoadManifest() {
+    auto text = fs->ReadTextFile(Manifest::FILE_NAME, "MOONLOADER");
+    if (text.empty()) return 0;
 
-    auto code = fs->ReadTextFile(path, core->LUA->GetPathID());
-    if (code.empty()) return false;
+    const char* pathID = core->LUA->GetPathID();
+    size_t loaded = 0;
+    for (auto& entry : Manifest::Parse(text)) {
+        CompiledFile compiled_file;
+        compiled_file.source_path = std::move(entry.source_path);
+        compiled_file.output_path = compiled_file.source_path;
+        Utils::Path::SetExtension(compiled_file.output_path, "lua");
 
-    watchdog->WatchFile(path, core->LUA->GetPathID());
+        if (!fs->Exists(compiled_file.source_path, pathID)) {
+            // Source was removed after deploy, its output must not be included instead
+            fs->Remove(compiled_file.output_path, "MOONLOADER");
+            continue;
+        }
 
-    CompiledFile compiled_file;
-    std::string lua_code;
-    compiled_file.source_path = path;
+        // Changed sources are compiled as usual on their first include
+        auto code = fs->ReadTextFile(compiled_file.source_path, pathID);
+        if (!(GetSourceKey(compiled_file.source_path, code, pathID) == entry.source_key) || !fs->Exists(compiled_file.output_path, "MOONLOADER"))
+            continue;
+
+        compiled_file.type = entry.source_key.language == CompileCache::Language::Yuescript ? CompiledFile::Yuescript : CompiledFile::Moonscript;
+        compiled_file.source_key = entry.source_key;
+        compiled_file.output_hash = entry.output_hash;
+        compiled_file.line_map = std::move(entry.line_map);
+        compiled_file.full_source_path = fs->TransverseRelativePath(compiled_file.source_path, pathID, "garrysmod");
+        compiled_file.full_output_path = fs->TransverseRelativePath(compiled_file.output_path, "MOONLOADER", "garrysmod");
+        compiled_file.update_date = fs->GetFileTime(compiled_file.source_path, pathID);
+
+        // Same as after compilation, so autorefresh and dependents work for precompiled files too
+        watchdog->WatchFile(compiled_file.source_path, pathID);
+        compiled_file.watched = watchdog->IsFileWatched(compiled_file.source_path);
+        SetImports(compiled_file.source_path, ResolveImports(compiled_file.source_path, code, pathID));
+        AddCompiledFile(std::move(compiled_file));
+        loaded++;
+    }
+    return loaded;
+}
+
+std::vector<std::string> Compiler::ResolveImports(const std::string& path, std::string_view code, const char* pathID) const {
+    if (Utils::Path::Extension(path) != "yue") return {};
+    return Yuescript::ResolveImports(path, code, [this, pathID](const std::string& import_path) {
+        return fs->Exists(import_path, pathID);
+    });
+}
+
+CompileCache::Key Compiler::GetSourceKey(const std::string& path, std::string_view code, const char* pathID) const {
+    if (Utils::Path::Extension(path) != "yue")
+        return CompileCache::MoonscriptKey(code);
+
+    yue::YueConfig config;
+    Yuescript::DefaultConfig(config);
+
+    // Macros are expanded into the code, so it must be compiled again when imported modules change
+    uint64_t imports_hash = 0;
+    if (Yuescript::MayUseMacros(code)) {
+        std::unordered_set<std::string> visited = {path};
+        imports_hash = Yuescript::HashImports(path, code,
+            [this, pathID](const std::string& import_path) { return fs->Exists(import_path, pathID); },
+            [this, pathID](const std::string& import_path) { return fs->ReadTextFile(import_path, pathID); },
+            visited, 0);
+    }
+    return CompileCache::YuescriptKey(code, config, imports_hash);
+}
+
+void Compiler::SetImports(const std::string& path, const std::vector<std::string>& imports) {
+    if (imports.empty() && dependencies.find(path) == dependencies.end()) return;
+
+    auto& node = dependencies[path];
+    for (const auto& old : node.imports)
+        if (node.includes.find(old) == node.includes.end())
+            dependents[old].erase(path);
+    node.imports.clear();
+
+    const char* pathID = core->LUA->GetPathID();
+    for (const auto& import_path : imports) {
+        // Macro modules are never included, so nobody else would watch them
+        watchdog->WatchFile(import_path, pathID);
+        node.imports.insert(import_path);
+        dependents[import_path].insert(path);
+    }
+}
+
+void Compiler::AddInclude(const std::string& path, const std::string& included) {
+    if (path == included) return;
+    if (dependencies[path].includes.insert(included).second)
+        dependents[included].insert(path);
+}
+
+void Compiler::RemoveIncludes(const std::string& path) {
+    auto it = dependencies.find(path);
+    if (it == dependencies.end()) return;
+
+    auto& node = it->second;
+    for (const auto& included : node.includes)
+        if (node.imports.find(included) == node.imports.end())
+            dependents[included].erase(path);
+    node.includes.clear();
+}
+
+std::vector<std::string> Compiler::FindDependents(const std::string& path, bool includes) const {
+    // Reverse edges don't know their kind, imports are looked up in dependencies of the dependent
+    auto follows = [&](const std::string& dependent, const std::string& file) {
+        if (includes) return true;
+        auto it = dependencies.find(dependent);
+        return it != dependencies.end() && it->second.imports.find(file) != it->second.imports.end();
+    };
+
+    std::unordered_set<std::string> affected;
+    std::vector<std::string> stack = {path};
+    while (!stack.empty()) {
+        auto current = std::move(stack.back());
+        stack.pop_back();
+        if (auto it = dependents.find(current); it != dependents.end())
+            for (const auto& dependent : it->second)
+                if (dependent != path && follows(dependent, current) && affected.insert(dependent).second)
+                    stack.push_back(dependent);
+    }
+
+    // Kahn's algorithm over affected files, sorted first so the order is stable
+    std::vector<std::string> files(affected.begin(), affected.end());
+    std::sort(files.begin(), files.end());
+    std::unordered_map<std::string_view, size_t> pending; // Dependencies which are affected too
+    for (const auto& file : files)
+        pending.try_emplace(file, 0);
+    for (const auto& file : files)
+        if (auto it = dependents.find(file); it != dependents.end())
+            for (const auto& dependent : it->second)
+                if (auto count = pending.find(dependent); count != pending.end() && follows(dependent, file))
+                    count->second++;
+
+    std::vector<std::string> order;
+    std::deque<std::string_view> ready;
+    for (const auto& file : files)
+        if (pending[file] == 0) ready.push_back(file);
+    while (!ready.empty()) {
+        auto file = ready.front();
+        ready.pop_front();
+        order.emplace_back(file);
+        if (auto it = dependents.find(order.back()); it != dependents.end())
+            for (const auto& dependent : it->second)
+                if (auto count = pending.find(dependent); count != pending.end() && follows(dependent, order.back()) && --count->second == 0)
+                    ready.push_back(count->first);
+    }
+
+    // Files of dependency cycles never become ready, they go last in any order
+    if (order.size() < files.size()) {
+        std::unordered_set<std::string_view> ordered(order.begin(), order.end());
+        for (const auto& file : files)
+            if (ordered.find(file) == ordered.end())
+                order.push_back(file);
+    }
+    return order;
+}
+
+std::optional<bool> Compiler::FindPreviousResult(const std::string& path, const CompileCache::Key& key) {
+    if (auto it = compiled_files.find(path); it != compiled_files.end() && it->second.source_key == key) {
+        // File was touched or rewritten with the same content, only its date is updated
+        it->second.update_date = fs->GetFileTime(path, core->LUA->GetPathID());
+        return true;
+    }
+
+    if (auto it = failed_files.find(path); it != failed_files.end() && it->second.source_key == key) {
+        DevMsg("[Moonloader] Skipping compilation of '%s', it failed before and wasn't changed since\n", path.c_str());
+        return false;
+    }
+
+    return std::nullopt;
+}
+
+Compiler::CompileResult Compiler::CompileCode(MoonEngine::Engine& engine, const std::string& path, std::string_view code, const CompileCache::Key& key, bool incremental) {
+    CompileResult result;
     if (Utils::Path::Extension(path) == "yue") {
-        // Yeah.. for every compilation we need to recraete yuecompiler
-        // You might ask why? Because Yuecompiler does not
-        // clear its internal state after compilation
         yue::YueConfig config;
-        config.options["target"] = "5.2"; // LuaJIT is 5.2 compat
-        auto info = yue::YueCompiler(nullptr, yue_openlibs).compile(code, config);
+        Yuescript::DefaultConfig(config);
+
+        // Compiler of this thread is reused, its macro state is cleaned after every compilation
+        auto info = Yuescript::Compile(code, config);
+        result.type = CompiledFile::Yuescript;
         if (info.error) {
-            Warning("[Moonloader] Yuescript compilation of '%s' failed:\n%s\n", path.c_str(), info.error->displayMessage.c_str());
-            return false;
+            result.error = std::move(info.error->displayMessage);
+            return result;
         }
-        compiled_file.line_map = ParseYueLines(info.codes);
-        compiled_file.type = CompiledFile::Yuescript;
-        lua_code = std::move(info.codes);
+        result.entry = CompileCache::Get().Insert(key, CompileCache::Entry::FromYuescript(std::move(info.codes)));
     } else {
-        auto info = moonengine->CompileString2(code);
+        // Every worker reuses its compile info, and lua code goes straight into the cache entry
+        thread_local MoonEngine::CompileInfo info;
+        CompileCache::Entry entry;
+        MoonEngine::StringSink sink(entry.lua_code);
+        if (incremental) engine.CompileIncremental(path, code, info, sink);
+        else engine.CompileInto(code, info, sink);
+        result.type = CompiledFile::Moonscript;
         if (info.error) {
-            Warning("[Moonloader] Moonscript compilation of '%s' failed:\n%s\n", path.c_str(), info.error->display_msg.c_str());
-            return false;
+            result.error = info.error->display_msg;
+            return result;
         }
-        compiled_file.type = CompiledFile::Yuescript;
-        lua_code = std::move(info.lua_code);
-        for (const auto& [source_line, pos] : info.posmap)
-            compiled_file.line_map[source_line] = pos.line;
+        entry.posmap = info.posmap;
+        result.entry = CompileCache::Get().Insert(key, std::move(entry));
+    }
+    return result;
+}
+
+std::future<Compiler::CompileResult> Compiler::CompileSource(const std::string& path, std::string code, const CompileCache::Key& key, bool incremental) {
+    bool is_yuescript = Utils::Path::Extension(path) == "yue";
+    if (auto entry = CompileCache::Get().Find(key)) {
+        // Same source was already compiled, no need to bother workers
+        std::promise<CompileResult> cached;
+        cached.set_value({is_yuescript ? CompiledFile::Yuescript : CompiledFile::Moonscript, std::move(entry)});
+        return cached.get_future();
     }
 
-    std::string dir = path;
-    Utils::Path::StripFileName(dir);
-    fs->CreateDirs(dir, "MOONLOADER");
+    auto compile = [incremental, path, key, code = std::move(code)](MoonEngine::Engine& engine) {
+        return CompileCode(engine, path, code, key, incremental);
+    };
+
+    if (incremental && !is_yuescript)
+        return moonengine->RunOn(std::hash<std::string>{}(path), std::move(compile));
+    return moonengine->Run(std::move(compile));
+}
+
+std::optional<Compiler::CompiledFile> Compiler::WriteOutput(const std::string& path, const char* pathID, const CompileCache::Key& key, const CompileResult& result, uint64_t previous_output_hash) {
+    CompiledFile compiled_file;
+    compiled_file.source_path = path;
+    compiled_file.type = result.type;
+    compiled_file.source_key = key;
+    for (const auto& [lua_line, pos] : result.entry->posmap)
+        compiled_file.line_map[lua_line] = pos.line;
 
     compiled_file.output_path = path;
     Utils::Path::SetExtension(compiled_file.output_path, "lua");
-    if (!fs->WriteToFile(compiled_file.output_path, "MOONLOADER", lua_code.c_str(), lua_code.size()))
-        return false;
+    const auto& lua_code = result.entry->lua_code;
+    compiled_file.output_hash = CompileCache::Hash(lua_code);
+
+    // Same output is already on the disk, so engine doesn't need to see it changed
+    if (previous_output_hash != compiled_file.output_hash) {
+        std::string dir = path;
+        Utils::Path::StripFileName(dir);
+        fs->CreateDirs(dir, "MOONLOADER");
 
-    compiled_file.full_source_path = fs->TransverseRelativePath(compiled_file.source_path, core->LUA->GetPathID(), "garrysmod");
+        if (!fs->WriteToFile(compiled_file.output_path, "MOONLOADER", lua_code.c_str(), lua_code.size()))
+            return std::nullopt;
+    }
+
+    compiled_file.full_source_path = fs->TransverseRelativePath(compiled_file.source_path, pathID, "garrysmod");
     compiled_file.full_output_path = fs->TransverseRelativePath(compiled_file.output_path, "MOONLOADER", "garrysmod");
-    compiled_file.update_date = fs->GetFileTime(path, core->LUA->GetPathID());
-    compiled_files.insert_or_assign(path, compiled_file);
+    compiled_file.update_date = fs->GetFileTime(path, pathID);
+    return compiled_file;
+}
+
+bool Compiler::AddCompileResult(const std::string& path, const CompileCache::Key& key, CompileResult&& result, std::optional<CompiledFile>&& compiled_file) {
+    SetImports(path, result.imports);
+    if (result.error) {
+        Warning("[Moonloader] %s compilation of '%s' failed:\n%s\n", 
+            result.type == CompiledFile::Yuescript ? "Yuescript" : "Moonscript", 
+            path.c_str(), result.error->c_str());
+        failed_files.insert_or_assign(path, FailedFile{key, std::move(*result.error)});
+        return false;
+    }
+    failed_files.erase(path);
+    if (!compiled_file) return false;
 
+    if (auto previous = compiled_files.find(path); previous == compiled_files.end() || previous->second.output_hash != compiled_file->output_hash)
+        RemoveIncludes(path);
+
+    compiled_file->watched = watchdog->IsFileWatched(path);
+    AddCompiledFile(std::move(*compiled_file));
     return true;
 }
+
+bool Compiler::WriteCompiledFile(const std::string& path, const CompileCache::Key& key, CompileResult&& result) {
+    std::optional<CompiledFile> compiled_file;
+    if (!result.error) {
+        auto previous = compiled_files.find(path);
+        compiled_file = WriteOutput(path, core->LUA->GetPathID(), key, result, previous != compiled_files.end() ? previous->second.output_hash : 0);
+    }
+    return AddCompileResult(path, key, std::move(result), std::move(compiled_file));
+}
+
+void Compiler::AddCompiledFile(CompiledFile&& compiled_file) {
+    // Old paths are erased before the entry is replaced, keys of indexes point to its strings
+    if (auto it = compiled_files.find(compiled_file.source_path); it != compiled_files.end()) {
+        const auto& old = it->second;
+        if (auto index = files_by_full_source_path.find(old.full_source_path); index != files_by_full_source_path.end() && index->second == &old)
+            files_by_full_source_path.erase(index);
+        if (auto index = files_by_full_output_path.find(old.full_output_path); index != files_by_full_output_path.end() && index->second == &old)
+            files_by_full_output_path.erase(index);
+    }
+
+    // Nodes of unordered_map are stable, so indexes can keep pointers to them
+    auto path = compiled_file.source_path;
+    const auto& info = compiled_files.insert_or_assign(std::move(path), std::move(compiled_file)).first->second;
+    files_by_full_source_path.erase(info.full_source_path);
+    files_by_full_source_path.emplace(info.full_source_path, &info);
+    files_by_full_output_path.erase(info.full_output_path);
+    files_by_full_output_path.emplace(info.full_output_path, &info);
+}
+
+bool Compiler::CompileFile(const std::string& path, bool force, bool incremental) {
+    if (!force && !NeedsCompile(path)) return true;
+
+    // Watch before reading, changes made while file compiles will mark it dirty again
+    watchdog->WatchFile(path, core->LUA->GetPathID());
+    watchdog->ClearDirty(path);
+
+    auto code = fs->ReadTextFile(path, core->LUA->GetPathID());
+    if (code.empty()) return false;
+
+    auto key = GetSourceKey(path, code, core->LUA->GetPathID());
+    if (auto previous = FindPreviousResult(path, key))
+        return *previous;
+
+    auto imports = ResolveImports(path, code, core->LUA->GetPathID());
+
+    auto result = CompileSource(path, std::move(code), key, incremental).get();
+    result.imports = std::move(imports);
+    return WriteCompiledFile(path, key, std::move(result));
+}
+
+Compiler::BatchResult Compiler::CompileBatchJob(MoonEngine::Engine& engine, const BatchJob& job) {
+    BatchResult result;
+    result.path = job.path;
+
+    auto code = fs->ReadTextFile(job.path, job.pathID);
+    result.bytes = code.size();
+    if (code.empty()) return result;
+
+    result.key = GetSourceKey(job.path, code, job.pathID);
+    if (job.compiled_key == result.key) {
+        result.previous = true;
+        result.update_date = fs->GetFileTime(job.path, job.pathID);
+        return result;
+    }
+    if (job.failed_key == result.key) {
+        result.previous = false;
+        return result;
+    }
+
+    if (auto entry = CompileCache::Get().Find(result.key))
+        result.result = {Utils::Path::Extension(job.path) == "yue" ? CompiledFile::Yuescript : CompiledFile::Moonscript, std::move(entry)};
+    else
+        result.result = CompileCode(engine, job.path, code, result.key, false);
+    result.result.imports = ResolveImports(job.path, code, job.pathID);
+
+    if (!result.result.error)
+        result.compiled_file = WriteOutput(job.path, job.pathID, result.key, result.result, job.output_hash);
+    return result;
+}
+
+bool Compiler::AddBatchResult(BatchResult&& result) {
+    if (result.bytes == 0) return false;
+
+    if (result.previous) {
+        if (auto it = compiled_files.find(result.path); *result.previous && it != compiled_files.end())
+            it->second.update_date = result.update_date;
+        else if (!*result.previous)
+            DevMsg("[Moonloader] Skipping compilation of '%s', it failed before and wasn't changed since\n", result.path.c_str());
+        return *result.previous;
+    }
+
+    return AddCompileResult(result.path, result.key, std::move(result.result), std::move(result.compiled_file));
+}
+
+Compiler::BatchSummary Compiler::CompileBatch(const std::function<void(const PathCallback&)>& enumerate, bool force, const ProgressCallback& progress) {
+    auto start = std::chrono::steady_clock::now();
+    const char* pathID = core->LUA->GetPathID();
+
+    // Workers own it too, so they never touch freed memory if we leave early because of an exception
+    struct BatchState {
+        std::mutex lock;
+        std::condition_variable cv;
+        std::deque<BatchResult> finished;
+    };
+    auto state = std::make_shared<BatchState>();
+
+    BatchSummary summary;
+    size_t in_flight = 0, done = 0;
+    auto finish = [&](const std::string& path, bool success) {
+        done++;
+        if (success) summary.compiled++;
+        else summary.failures++;
+        if (progress) progress(path, success, done, summary.files);
+    };
+
+    // Registers finished files, waits for at least one of them if asked to
+    auto collect = [&](bool wait) {
+        std::deque<BatchResult> results;
+        {
+            std::unique_lock<std::mutex> guard(state->lock);
+            if (wait) state->cv.wait(guard, [&] { return !state->finished.empty(); });
+            std::swap(results, state->finished);
+        }
+
+        for (auto& result : results) {
+            in_flight--;
+            summary.bytes += result.bytes;
+            auto path = result.path;
+            finish(path, AddBatchResult(std::move(result)));
+        }
+    };
+
+    // Enumeration runs here, since filesystem searches and registry are main thread only.
+    // Every found file goes to workers right away, so they compile while directory is still searched
+    enumerate([&](std::string path) {
+        summary.files++;
+        if (!force && !NeedsCompile(path)) {
+            finish(path, true);
+            return;
+        }
+
+        watchdog->WatchFile(path, pathID);
+        watchdog->ClearDirty(path);
+
+        BatchJob job;
+        job.path = std::move(path);
+        job.pathID = pathID;
+        if (auto it = compiled_files.find(job.path); it != compiled_files.end()) {
+            job.compiled_key = it->second.source_key;
+            job.output_hash = it->second.output_hash;
+        }
+        if (auto it = failed_files.find(job.path); it != failed_files.end())
+            job.failed_key = it->second.source_key;
+
+        in_flight++;
+        moonengine->Run([this, job = std::move(job), state](MoonEngine::Engine& engine) {
+            BatchResult result;
+            try {
+                result = CompileBatchJob(engine, job);
+            } catch (const std::exception& e) {
+                result = BatchResult();
+                result.path = job.path;
+                result.bytes = 1; // Reported as failure of compilation below
+                result.result.type = Utils::Path::Extension(job.path) == "yue" ? CompiledFile::Yuescript : CompiledFile::Moonscript;
+                result.result.error = e.what();
+            }
+            std::lock_guard<std::mutex> guard(state->lock);
+            state->finished.push_back(std::move(result));
+            state->cv.notify_one();
+        });
+
+        collect(false);
+    });
+
+    while (in_flight > 0)
+        collect(true);
+
+    summary.time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return summary;
+}
+
+void Compiler::FindSourceFiles(const std::string& dir, const char* pathID, const PathCallback& found) {
+    for (const auto [fileName, isDir] : fs->Find(Utils::Path::Join(dir, "*"), pathID)) {
+        std::string path = Utils::Path::Join(dir, fileName);
+        if (fs->IsDirectory(path, pathID)) {
+            FindSourceFiles(path, pathID, found);
+        } else if (Utils::Path::Extension(path) == "moon" || Utils::Path::Extension(path) == "yue") {
+            found(std::move(path));
+        }
+    }
+}
+
+size_t Compiler::CompileFiles(const std::vector<std::string>& paths, bool force) {
+    return CompileBatch([&paths](const PathCallback& found) {
+        for (const auto& path : paths)
+            found(path);
+    }, force, nullptr).compiled;
+}
+
+Compiler::BatchSummary Compiler::CompileDir(const std::string& dir, const ProgressCallback& progress, bool force) {
+    const char* pathID = core->LUA->GetPathID();
+    return CompileBatch([this, &dir, pathID](const PathCallback& found) {
+        FindSourceFiles(dir, pathID, found);
+    }, force, progress);
+}
@@ -10,10 +10,15 @@
 #include <string_view>
 #include <optional>
 #include <memory>
+#include <vector>
+#include <future>
+#include <functional>
 #include <GarrysMod/Lua/LuaInterface.h>
 
+#include "compile_cache.hpp"
+
 namespace MoonEngine {
-    class Engine;
+    class EnginePool;
 }
 
 namespace MoonLoader {
@@ -34,44 +39,148 @@ namespace MoonLoader {
             std::string output_path;
             std::string full_output_path;
             size_t update_date = 0;
+            bool watched = false; // Watchdog reports its changes, so update_date doesn't need to be checked
+            CompileCache::Key source_key; // Unchanged sources are not compiled again
+            uint64_t output_hash = 0; // Unchanged outputs are not written again
             Type type;
 
             std::map<int, int> line_map;
         };
 
+        // Result of source compilation, before it was written to the disk
+        struct CompileResult {
+            CompiledFile::Type type;
+            std::shared_ptr<const CompileCache::Entry> entry;
+            std::optional<std::string> error;
+            std::vector<std::string> imports; // Sources imported by yuescript source
+        };
+
+        struct BatchSummary {
+            size_t files = 0; // Found sources
+            size_t compiled = 0; // Compiled or already up to date
+            size_t failures = 0;
+            size_t bytes = 0; // Read from sources
+            double time = 0; // In millis
+        };
+
+        // Called on main thread after every file of a batch, total grows while directory is being searched
+        using ProgressCallback = std::function<void(const std::string& path, bool success, size_t done, size_t total)>;
+
     private:
         std::shared_ptr<Core> core;
         std::shared_ptr<Filesystem> fs;
-        std::shared_ptr<MoonEngine::Engine> moonengine;
+        std::shared_ptr<MoonEngine::EnginePool> moonengine;
         std::shared_ptr<Watchdog> watchdog;
         std::unordered_map<std::string, CompiledFile> compiled_files;
+        // Reverse lookups, keys and values point into compiled_files. Kept in sync by AddCompiledFile
+        std::unordered_map<std::string_view, const CompiledFile*> files_by_full_source_path;
+        std::unordered_map<std::string_view, const CompiledFile*> files_by_full_output_path;
+
+        void AddCompiledFile(CompiledFile&& compiled_file);
+
+        // Sources which failed to compile, so they are not compiled again on every include
+        struct FailedFile {
+            CompileCache::Key source_key;
+            std::string error;
+        };
+        std::unordered_map<std::string, FailedFile> failed_files;
+
+        // Edges of dependency graph by source paths, file -> files it depends on
+        struct Dependencies {
+            std::unordered_set<std::string> imports; // Replaced on every compilation
+            std::unordered_set<std::string> includes; // Seen at runtime, cleared when output of includer changes
+        };
+        std::unordered_map<std::string, Dependencies> dependencies;
+        std::unordered_map<std::string, std::unordered_set<std::string>> dependents; // Reverse edges
+
+        // Watches imported sources, so their changes reach dependents
+        void SetImports(const std::string& path, const std::vector<std::string>& imports);
+        // Changed file records its includes again when it runs, so removed ones don't stay in the graph
+        void RemoveIncludes(const std::string& path);
+        // Existing sources of modules imported by yuescript code, can be called from any thread
+        std::vector<std::string> ResolveImports(const std::string& path, std::string_view code, const char* pathID) const;
+
+        // Can be called from any thread
+        CompileCache::Key GetSourceKey(const std::string& path, std::string_view code, const char* pathID) const;
+        // Result of the last compilation if source didn't change since then
+        std::optional<bool> FindPreviousResult(const std::string& path, const CompileCache::Key& key);
+
+        // Runs on moonengine worker thread
+        static CompileResult CompileCode(MoonEngine::Engine& engine, const std::string& path, std::string_view code, const CompileCache::Key& key, bool incremental);
+
+        // Compilation itself is done on moonengine worker thread
+        // Incremental compilation always uses the same engine for the path, so it can reuse parse trees of unchanged statements
+        std::future<CompileResult> CompileSource(const std::string& path, std::string code, const CompileCache::Key& key, bool incremental = false);
+        bool WriteCompiledFile(const std::string& path, const CompileCache::Key& key, CompileResult&& result);
+
+        // Writes output of successful compilation, can be called from any thread
+        std::optional<CompiledFile> WriteOutput(const std::string& path, const char* pathID, const CompileCache::Key& key, const CompileResult& result, uint64_t previous_output_hash);
+        // Registers written file or failure, main thread only
+        bool AddCompileResult(const std::string& path, const CompileCache::Key& key, CompileResult&& result, std::optional<CompiledFile>&& compiled_file);
+
+        // What worker needs to know about previous compilation of a file, copied from main thread
+        struct BatchJob {
+            std::string path;
+            const char* pathID;
+            std::optional<CompileCache::Key> compiled_key;
+            uint64_t output_hash = 0;
+            std::optional<CompileCache::Key> failed_key;
+        };
+
+        struct BatchResult {
+            std::string path;
+            CompileCache::Key key;
+            size_t bytes = 0; // Zero if source couldn't be read
+            std::optional<bool> previous; // Source didn't change since previous compilation, which succeeded or failed
+            size_t update_date = 0;
+            CompileResult result;
+            std::optional<CompiledFile> compiled_file;
+        };
+
+        // Reads, compiles and writes file on worker thread
+        BatchResult CompileBatchJob(MoonEngine::Engine& engine, const BatchJob& job);
+        bool AddBatchResult(BatchResult&& result);
+
+        // Paths are produced by enumerate on main thread, and compiled by workers while it is still running
+        typedef std::function<void(std::string path)> PathCallback;
+        BatchSummary CompileBatch(const std::function<void(const PathCallback&)>& enumerate, bool force, const ProgressCallback& progress);
+        void FindSourceFiles(const std::string& dir, const char* pathID, const PathCallback& found);
 
     public:
         Compiler(std::shared_ptr<Core> core,
                  std::shared_ptr<Filesystem> fs,
-                 std::shared_ptr<MoonEngine::Engine> moonengine, 
+                 std::shared_ptr<MoonEngine::EnginePool> moonengine, 
                  std::shared_ptr<Watchdog> watchdog)
             : core(core), fs(fs), moonengine(moonengine), watchdog(watchdog) {}
 
         bool NeedsCompile(const std::string& path);
+        // Trusts outputs of moonloader-precompile whose sources didn't change since, returns how many were loaded
+        size_t LoadManifest();
         const CompiledFile* FindFileByFullSourcePath(const std::string& full_source_path) const {
-            for (const auto& [path, info] : compiled_files)
-                if (info.full_source_path == full_source_path)
-                    return &info;
-            return nullptr;
+            auto it = files_by_full_source_path.find(full_source_path);
+            return it == files_by_full_source_path.end() ? nullptr : it->second;
         }
         const CompiledFile* FindFileByFullOutputPath(std::string_view full_output_path) const {
-            for (const auto& [path, info] : compiled_files)
-                if (info.full_output_path == full_output_path)
-                    return &info;
-            return nullptr;
+            auto it = files_by_full_output_path.find(full_output_path);
+            return it == files_by_full_output_path.end() ? nullptr : it->second;
         }
         const CompiledFile* FindFileBySourcePath(const std::string& path) const {
             auto it = compiled_files.find(path);
             return it == compiled_files.end() ? nullptr : &it->second;
         }
 
-        bool CompileFile(const std::string& path, bool force = false);
+        // Incremental compilation is meant for autorefresh, which recompiles the same file after small edits
+        bool CompileFile(const std::string& path, bool force = false, bool incremental = false);
+        // Compiles all given files in parallel, returns how many were compiled successfully
+        size_t CompileFiles(const std::vector<std::string>& paths, bool force = false);
+        // Compiles every source in given lua directory, files start compiling while directory is still searched
+        BatchSummary CompileDir(const std::string& dir, const ProgressCallback& progress = nullptr, bool force = false);
+
+        // Records that compiled file includes another one at runtime
+        void AddInclude(const std::string& path, const std::string& included);
+        // Every file which depends on given one, directly or not. Dependencies go before their dependents.
+        // Include edges are only followed if asked, since included file never changes compiled output of includer
+        std::vector<std::string> FindDependents(const std::string& path, bool includes = false) const;
     };
 }
 
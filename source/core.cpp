@@ -4,7 +4,7 @@
 #include "utils.hpp"
 #include "lua_api.hpp"
 
-#include <moonengine/engine.hpp>
+#include <moonengine/pool.hpp>
 
 using namespace MoonLoader;
 
@@ -13,6 +13,8 @@ using namespace MoonLoader;
 #include "compiler.hpp"
 #include "watchdog.hpp"
 #include "errors.hpp"
+#include "compile_cache.hpp"
+#include "manifest.hpp"
 #include <GarrysMod/InterfacePointers.hpp>
 #include <detouring/classproxy.hpp>
 #include <detouring/hook.hpp>
@@ -26,8 +28,19 @@ extern "C" {
 
 ConVar Core::cvar_detour_getinfo("moonloader_detour_getinfo", "1", FCVAR_ARCHIVE, "Detour debug.getinfo for better source lines");
 
+inline void UpdateCompileCacheSize() {
+    float megabytes = std::max(Core::cvar_compile_cache_size.GetFloat(), 0.0f);
+    CompileCache::Get().SetBudget(static_cast<size_t>(megabytes * 1024 * 1024));
+}
+ConVar Core::cvar_compile_cache_size("moonloader_compile_cache_size", "64", FCVAR_ARCHIVE, "Memory budget of compiled sources cache in megabytes, 0 disables it",
+    [](IConVar*, const char*, float) { UpdateCompileCacheSize(); });
+
+ConVar Core::cvar_watch_freshness("moonloader_watch_freshness", "1", FCVAR_ARCHIVE, "Trust file watcher to detect changed sources instead of checking their modification time on every include");
+
 std::vector<ConVar*> moonloader_convars = {
-    &Core::cvar_detour_getinfo
+    &Core::cvar_detour_getinfo,
+    &Core::cvar_compile_cache_size,
+    &Core::cvar_watch_freshness
 };
 
 #define FILESYSTEM_INTERFACE_VERSION "VFileSystem022"
@@ -63,6 +76,11 @@ public:
             std::string pathID = _pathID.c_str();
 
             if (pathID == "lsv" && core->FindMoonScript(path)) {
+                // Finding includer takes a few debug.getinfo calls, so includes are only tracked for autorefresh
+                if (core->watchdog->IsActive() && core->lua_api)
+                    if (auto includer = core->lua_api->FindCallingFile(LUA))
+                        core->compiler->AddInclude(*includer, path);
+
                 if (!core->compiler->CompileFile(path))
                     return nullptr;
 
@@ -111,7 +129,9 @@ public:
 
     virtual void Cycle() {
         Call(&GarrysMod::Lua::ILuaInterface::Cycle);
-        if (auto core = Core::Get(This()); core && core->watchdog) core->watchdog->Think();
+        auto core = Core::Get(This());
+        if (core && core->watchdog) core->watchdog->Think();
+        if (core && core->lua_api) core->lua_api->Think(This());
     }
 
     //virtual bool FindAndRunScript(const char* fileName, bool run, bool showErrors, const char* runReason, bool noReturns) {
@@ -202,6 +222,7 @@ size_t Core::PrepareDirectory(std::string_view path) {
                 auto fileDir = filePath;
                 Utils::Path::StripFileName(fileDir);
                 Utils::Path::SetExtension(filePath, "lua");
+                if (fs->Exists(filePath, "MOONLOADER")) continue; // Precompiled output, or stale one which is replaced on include
                 fs->CreateDirs(fileDir, "MOONLOADER");
                 fs->WriteToFile(filePath, "MOONLOADER", nullptr, 0); // Just create a dummy file
                 files++;
@@ -258,7 +279,7 @@ void Core::Initialize(GarrysMod::Lua::ILuaInterface* LUA) {
         throw std::runtime_error("core is not valid shared_ptr (weak_ptr is expired)");
 
     try {
-        moonengine = std::make_shared<MoonEngine::Engine>();
+        moonengine = std::make_shared<MoonEngine::EnginePool>();
     } catch (const std::exception& e) {
         throw std::runtime_error(Utils::Format("failed to initialize moonengine: %s", e.what()));
     }
@@ -279,7 +300,9 @@ void Core::Initialize(GarrysMod::Lua::ILuaInterface* LUA) {
     lua_interface_detour = std::make_shared<ILuaInterfaceProxy>(LUA);
     lua_shared_detour = std::make_shared<ILuaSharedProxy>(lua_shared);
 
-    DevMsg("[Moonloader] Removed %d files from cache\n", fs->Remove(CACHE_PATH, "GAME_WRITE"));
+    // Outputs of moonloader-precompile are kept, compiler trusts them while their sources don't change
+    if (!fs->Exists(std::string(CACHE_PATH_LUA) + Manifest::FILE_NAME, "GAME_WRITE"))
+        DevMsg("[Moonloader] Removed %d files from cache\n", fs->Remove(CACHE_PATH, "GAME_WRITE"));
     fs->CreateDirs(CACHE_PATH_LUA);
     fs->AddSearchPath("garrysmod/" CACHE_PATH, "GAME", true);
     fs->AddSearchPath("garrysmod/" CACHE_PATH_LUA, "MOONLOADER");
@@ -296,7 +319,10 @@ void Core::Initialize(GarrysMod::Lua::ILuaInterface* LUA) {
     g_pCVar = cvar;
     for (ConVar* convar : moonloader_convars)
         cvar->RegisterConCommand(convar);
+    UpdateCompileCacheSize();
 
+    if (size_t precompiled = compiler->LoadManifest())
+        DevMsg("[Moonloader] Loaded %zu precompiled files\n", precompiled);
     PrepareFiles();
 #endif
 
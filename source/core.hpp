@@ -20,7 +20,7 @@ namespace Detouring {
 }
 
 namespace MoonEngine {
-    class Engine;
+    class EnginePool;
 }
 
 namespace MoonLoader {
@@ -36,7 +36,7 @@ namespace MoonLoader {
     public:
         GarrysMod::Lua::ILuaInterface* LUA = nullptr;
         GarrysMod::Lua::ILuaShared* lua_shared = nullptr;
-        std::shared_ptr<MoonEngine::Engine> moonengine;
+        std::shared_ptr<MoonEngine::EnginePool> moonengine;
         std::shared_ptr<LuaAPI> lua_api;
         std::shared_ptr<Filesystem> fs;
         IVEngineServer* engine_server = nullptr;
@@ -47,6 +47,8 @@ namespace MoonLoader {
         std::shared_ptr<Errors> errors;
 
         static ConVar cvar_detour_getinfo;
+        static ConVar cvar_compile_cache_size;
+        static ConVar cvar_watch_freshness;
 
         static inline std::shared_ptr<Core> Create() { return std::make_shared<Core>(); }
         static std::shared_ptr<Core> Get(GarrysMod::Lua::ILuaBase* LUA);
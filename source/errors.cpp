@@ -57,12 +57,10 @@ std::optional<ErrorLine> Errors::TransformErrorMessage(std::string& error_messag
     return {};
 }
 
-inline std::map<int, std::string> ReadLines(std::string_view code, int bottom_line, int top_line) {
+inline std::map<int, std::string> ReadLines(std::string_view code, const MoonEngine::LineIndex& index, int bottom_line, int top_line) {
     std::map<int, std::string> lines;
-    Utils::Split(code, [&](auto line_str, auto current_line) {
-        if (current_line < bottom_line || current_line > top_line) return;
-        lines[current_line] = line_str;
-    });
+    for (int line = std::max(bottom_line, 1); line <= std::min(top_line, index.LineCount()); line++)
+        lines[line] = index.Line(code, line);
     return lines;
 }
 
@@ -82,7 +80,9 @@ inline void TrimLines(std::map<int, std::string>& lines) {
 }
 
 void Errors::PrintSourceFile(std::string_view code, const ErrorLine& error) {
-    auto lines = ReadLines(code, std::max(error.line - 5, 0), error.line + 2);
+    // Source is read from the disk after the error, so index of its compilation could be outdated
+    MoonEngine::LineIndex index(code);
+    auto lines = ReadLines(code, index, std::max(error.line - 5, 0), error.line + 2);
 
     TrimLines(lines);
 
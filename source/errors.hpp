@@ -7,6 +7,7 @@
 #include <GarrysMod/Lua/LuaGameCallback.h>
 #include <GarrysMod/Lua/LuaInterface.h>
 #include <optional>
+#include <moonengine/engine.hpp>
 
 namespace MoonLoader {
     class Core;
@@ -4,52 +4,21 @@
 #include "core.hpp"
 #include "utils.hpp"
 #include "compiler.hpp"
+#include "compile_cache.hpp"
+#include "yuescript.hpp"
 
 #include <GarrysMod/Lua/Interface.h>
-#include <moonengine/engine.hpp>
+#include <moonengine/pool.hpp>
 #include <yuescript/yue_compiler.h>
 
+#include <chrono>
+
 #if IS_SERVERSIDE
 #include "compiler.hpp"
 #include "filesystem.hpp"
 #include <tier1/convar.h>
 #endif
 
-extern "C" {
-#include "lauxlib.h"
-#include "lua.h"
-#include "lualib.h"
-int luaopen_yue(lua_State* L);
-int luaopen_bit32(lua_State* L);
-LUALIB_API void luaL_requiref (lua_State *L, const char *modname,
-                               lua_CFunction openf, int glb);
-} // extern "C"
-
-inline const luaL_Reg loadedlibs[] = {
-    {"_G", luaopen_base},
-    {LUA_LOADLIBNAME, luaopen_package},
-    //   {LUA_COLIBNAME, luaopen_coroutine},
-    {LUA_TABLIBNAME, luaopen_table},
-    //   {LUA_IOLIBNAME, luaopen_io},
-    //   {LUA_OSLIBNAME, luaopen_os},
-    {LUA_STRLIBNAME, luaopen_string},
-    {"bit", luaopen_bit32},
-    {LUA_MATHLIBNAME, luaopen_math},
-    {LUA_DBLIBNAME, luaopen_debug},
-    {"yue", luaopen_yue},
-    {NULL, NULL}
-};
-
-void yue_openlibs(void* state) {
-    lua_State* L = static_cast<lua_State*>(state);
-    const luaL_Reg *lib;
-    /* call open functions from 'loadedlibs' and set results to global table */
-    for (lib = loadedlibs; lib->func; lib++) {
-        luaL_requiref(L, lib->name, lib->func, 1);
-        lua_pop(L, 1);  /* remove lib */
-    }
-}
-
 using namespace MoonLoader;
 
 inline void ParseYueConfig(GarrysMod::Lua::ILuaBase* LUA, yue::YueConfig& config, int index) {
@@ -83,6 +52,42 @@ inline void ParseYueConfig(GarrysMod::Lua::ILuaBase* LUA, yue::YueConfig& config
     if (LUA->IsType(-1, Type::String)) config.module = std::string(Utils::GetString(LUA, -1)); LUA->Pop();
 }
 
+// Pushes lua_code and line_table
+inline void PushMoonscriptResult(GarrysMod::Lua::ILuaBase* LUA, const CompileCache::Entry& entry) {
+    Utils::PushString(LUA, entry.lua_code);
+
+    LUA->CreateTable();
+    for (auto& line : entry.posmap) {
+        LUA->PushNumber(line.first);
+        LUA->PushNumber(line.second.offset);
+        LUA->SetTable(-3);
+    }
+}
+
+inline void PushYueGlobals(GarrysMod::Lua::ILuaBase* LUA, const yue::GlobalVars& globals) {
+    LUA->CreateTable();
+    double i = 1;
+    for (const auto& var : globals) {
+        LUA->PushNumber(i);
+        LUA->CreateTable();
+
+        LUA->PushNumber(1);
+        Utils::PushString(LUA, var.name);
+        LUA->SetTable(-3);
+
+        LUA->PushNumber(2);
+        LUA->PushNumber(var.line);
+        LUA->SetTable(-3);
+
+        LUA->PushNumber(1);
+        LUA->PushNumber(var.col);
+        LUA->SetTable(-3);
+
+        LUA->SetTable(-3);
+        i++;
+    }
+}
+
 namespace Functions {
     LUA_FUNCTION(EmptyFunc) {
         return 0;
@@ -90,27 +95,79 @@ namespace Functions {
 
     LUA_FUNCTION(ToLua) {
         if (auto core = Core::Get(LUA); core && core->moonengine) {
-            LUA->CheckType(1, GarrysMod::Lua::Type::String);
-            unsigned int codeLen = 0;
-            const char* code = LUA->GetString(1, &codeLen);
+            auto code = Utils::CheckString(LUA, 1);
+
+            auto key = CompileCache::MoonscriptKey(code);
+            auto entry = CompileCache::Get().Find(key);
+            if (!entry) {
+                auto info = core->moonengine->Compile(code);
+                if (info.error) {
+                    LUA->PushNil();
+                    Utils::PushString(LUA, info.error->display_msg);
+                    return 2;
+                }
+                entry = CompileCache::Get().Insert(key, CompileCache::Entry::FromMoonscript(std::move(info)));
+            }
 
-            auto info = core->moonengine->CompileString2({code, codeLen});
-            if (info.error) {
-                LUA->PushNil();
-                LUA->PushString(info.error->display_msg.c_str());
-            } else {
-                // lua_code
-                LUA->PushString(info.lua_code.c_str());
-
-                // line_table
-                LUA->CreateTable();
-                for (auto& line : info.posmap) {
-                    LUA->PushNumber(line.first);
-                    LUA->PushNumber(line.second.offset);
-                    LUA->SetTable(-3);
+            PushMoonscriptResult(LUA, *entry);
+            return 2;
+        }
+        return 0;
+    }
+
+    // ToLuaMany({code, ...}) -> {lua_code or false, ...}, {error or false, ...}
+    LUA_FUNCTION(ToLuaMany) {
+        LUA->CheckType(1, GarrysMod::Lua::Type::Table);
+        int count = LUA->ObjLen(1);
+        // Check everything before any C++ objects are alive, lua errors don't unwind them
+        for (int i = 1; i <= count; i++) {
+            LUA->PushNumber(i);
+            LUA->GetTable(1);
+            if (!LUA->IsType(-1, GarrysMod::Lua::Type::String)) LUA->ArgError(1, "expected array of strings");
+            LUA->Pop();
+        }
+
+        if (auto core = Core::Get(LUA); core && core->moonengine) {
+            std::vector<CompileCache::Key> keys(count);
+            std::vector<std::shared_ptr<const CompileCache::Entry>> entries(count);
+            std::vector<std::string> errors(count);
+            std::vector<std::string_view> uncached;
+            std::vector<int> uncached_index;
+            for (int i = 0; i < count; i++) {
+                LUA->PushNumber(i + 1);
+                LUA->GetTable(1);
+                auto code = Utils::GetString(LUA, -1); // Still referenced by the table
+                LUA->Pop();
+
+                keys[i] = CompileCache::MoonscriptKey(code);
+                entries[i] = CompileCache::Get().Find(keys[i]);
+                if (!entries[i]) {
+                    uncached.push_back(code);
+                    uncached_index.push_back(i);
                 }
             }
 
+            auto infos = core->moonengine->CompileBatch(uncached);
+            for (size_t j = 0; j < infos.size(); j++) {
+                int i = uncached_index[j];
+                if (infos[j].error) errors[i] = std::move(infos[j].error->display_msg);
+                else entries[i] = CompileCache::Get().Insert(keys[i], CompileCache::Entry::FromMoonscript(std::move(infos[j])));
+            }
+
+            LUA->CreateTable();
+            for (int i = 0; i < count; i++) {
+                LUA->PushNumber(i + 1);
+                if (entries[i]) Utils::PushString(LUA, entries[i]->lua_code);
+                else LUA->PushBool(false);
+                LUA->SetTable(-3);
+            }
+            LUA->CreateTable();
+            for (int i = 0; i < count; i++) {
+                LUA->PushNumber(i + 1);
+                if (!entries[i]) Utils::PushString(LUA, errors[i]);
+                else LUA->PushBool(false);
+                LUA->SetTable(-3);
+            }
             return 2;
         }
         return 0;
@@ -122,46 +179,120 @@ namespace Functions {
         if (auto core = Core::Get(LUA)) { 
             auto input = Utils::GetString(LUA, 1);
             yue::YueConfig config;
-            config.options["target"] = "5.2"; // LuaJIT is 5.2 compat
+            Yuescript::DefaultConfig(config);
             if (LUA->Top() >= 2) ParseYueConfig(LUA, config, 2);
-            auto result = yue::YueCompiler(nullptr, yue_openlibs).compile(input, config);
+
+            // Globals are not stored in the cache, so linting always goes through the compiler.
+            // Code with macros depends on modules it imports, which can change without the code
+            bool cacheable = !config.lintGlobalVariable && !Yuescript::MayUseMacros(input);
+            auto key = CompileCache::YuescriptKey(input, config);
+            if (auto entry = cacheable ? CompileCache::Get().Find(key) : nullptr) {
+                Utils::PushString(LUA, entry->lua_code);
+                LUA->PushNil();
+                LUA->PushNil();
+                return 3;
+            }
+
+            auto result = Yuescript::Compile(input, config);
             if (result.error) LUA->PushNil();
+            else if (cacheable) Utils::PushString(LUA, CompileCache::Get().Insert(key, CompileCache::Entry::FromYuescript(std::move(result.codes)))->lua_code);
             else Utils::PushString(LUA, result.codes);
             if (result.error) Utils::PushString(LUA, result.error->displayMessage);
             else LUA->PushNil();
 
-            if (result.globals) {
-                LUA->CreateTable();
-                double i = 1;
-                for (const auto& var : *result.globals) {
-                    LUA->PushNumber(i);
-                    LUA->CreateTable();
-
-                    LUA->PushNumber(1);
-                    Utils::PushString(LUA, var.name);
-                    LUA->SetTable(-3);
+            if (result.globals) PushYueGlobals(LUA, *result.globals);
+            else LUA->PushNil();
+            return 3;
+        }
+        return 0;
+    }
 
-                    LUA->PushNumber(2);
-                    LUA->PushNumber(var.line);
-                    LUA->SetTable(-3);
+#if IS_SERVERSIDE
+    // ToLuaAsync(code, callback), callback receives same values as ToLua returns
+    LUA_FUNCTION(ToLuaAsync) {
+        LUA->CheckType(1, GarrysMod::Lua::Type::String);
+        LUA->CheckType(2, GarrysMod::Lua::Type::Function);
+        if (auto core = Core::Get(LUA); core && core->moonengine && core->lua_api) {
+            std::string code(Utils::GetString(LUA, 1));
+            LUA->Push(2);
+            int callback_ref = LUA->ReferenceCreate();
+
+            core->lua_api->AddAsyncTask(core->moonengine->Run([code = std::move(code)](MoonEngine::Engine& engine) -> LuaAPI::AsyncResult {
+                auto key = CompileCache::MoonscriptKey(code);
+                auto entry = CompileCache::Get().Find(key);
+                if (!entry) {
+                    auto info = engine.CompileString2(code);
+                    if (info.error) {
+                        return [msg = std::move(info.error->display_msg)](GarrysMod::Lua::ILuaBase* LUA) {
+                            LUA->PushNil();
+                            Utils::PushString(LUA, msg);
+                            return 2;
+                        };
+                    }
+                    entry = CompileCache::Get().Insert(key, CompileCache::Entry::FromMoonscript(std::move(info)));
+                }
+                return [entry](GarrysMod::Lua::ILuaBase* LUA) {
+                    PushMoonscriptResult(LUA, *entry);
+                    return 2;
+                };
+            }), callback_ref);
+        }
+        return 0;
+    }
 
-                    LUA->PushNumber(1);
-                    LUA->PushNumber(var.col);
-                    LUA->SetTable(-3);
+    // yue.ToLuaAsync(code, options, callback), callback receives same values as yue.ToLua returns
+    LUA_FUNCTION(YueToLuaAsync) {
+        LUA->CheckType(1, GarrysMod::Lua::Type::String);
+        if (!LUA->IsType(2, GarrysMod::Lua::Type::Nil)) LUA->CheckType(2, GarrysMod::Lua::Type::Table);
+        LUA->CheckType(3, GarrysMod::Lua::Type::Function);
+        if (auto core = Core::Get(LUA); core && core->moonengine && core->lua_api) {
+            std::string input(Utils::GetString(LUA, 1));
+            yue::YueConfig config;
+            Yuescript::DefaultConfig(config);
+            if (LUA->IsType(2, GarrysMod::Lua::Type::Table)) ParseYueConfig(LUA, config, 2);
+            LUA->Push(3);
+            int callback_ref = LUA->ReferenceCreate();
+
+            // Yuescript doesn't need moonscript engine, but its worker thread is still good for us
+            core->lua_api->AddAsyncTask(core->moonengine->Run([input = std::move(input), config = std::move(config)](MoonEngine::Engine&) -> LuaAPI::AsyncResult {
+                bool cacheable = !config.lintGlobalVariable && !Yuescript::MayUseMacros(input);
+                auto key = CompileCache::YuescriptKey(input, config);
+                if (auto entry = cacheable ? CompileCache::Get().Find(key) : nullptr) {
+                    return [entry](GarrysMod::Lua::ILuaBase* LUA) {
+                        Utils::PushString(LUA, entry->lua_code);
+                        LUA->PushNil();
+                        LUA->PushNil();
+                        return 3;
+                    };
+                }
 
-                    LUA->SetTable(-3);
-                    i++;
+                auto result = std::make_shared<yue::CompileInfo>(Yuescript::Compile(input, config));
+                if (!result->error && cacheable) {
+                    auto entry = CompileCache::Get().Insert(key, CompileCache::Entry::FromYuescript(std::move(result->codes)));
+                    result->codes = entry->lua_code;
                 }
-            } else LUA->PushNil();
-            return 3;
+                return [result](GarrysMod::Lua::ILuaBase* LUA) {
+                    if (result->error) LUA->PushNil();
+                    else Utils::PushString(LUA, result->codes);
+                    if (result->error) Utils::PushString(LUA, result->error->displayMessage);
+                    else LUA->PushNil();
+                    if (result->globals) PushYueGlobals(LUA, *result->globals);
+                    else LUA->PushNil();
+                    return 3;
+                };
+            }), callback_ref);
         }
         return 0;
     }
+#endif
 
 #if IS_SERVERSIDE
+    // PreCacheDir(path, progress), progress receives path, success, done and total files found so far
     LUA_FUNCTION(PreCacheDir) {
+        std::string path = LUA->CheckString(1);
+        if (!LUA->IsType(2, GarrysMod::Lua::Type::Nil)) LUA->CheckType(2, GarrysMod::Lua::Type::Function);
         if (auto core = Core::Get(LUA)) {
-            core->lua_api->PreCacheDir(core->LUA, LUA->CheckString(1));
+            return core->lua_api->PreCacheDir(core->LUA, path, LUA->IsType(2, GarrysMod::Lua::Type::Function) ? 2 : 0);
         }
         return 0;
     }
@@ -203,14 +334,19 @@ void LuaAPI::Initialize(GarrysMod::Lua::ILuaInterface* LUA) {
     LUA->PushString(MOONLOADER_URL); LUA->SetField(-2, "_URL");
 
     LUA->PushCFunction(Functions::ToLua); LUA->SetField(-2, "ToLua");
+    LUA->PushCFunction(Functions::ToLuaMany); LUA->SetField(-2, "ToLuaMany");
     LUA->PushCFunction(Functions::EmptyFunc); LUA->SetField(-2, "PreCacheDir");
     LUA->PushCFunction(Functions::EmptyFunc); LUA->SetField(-2, "PreCacheFile");
 
     LUA->CreateTable();
     LUA->PushCFunction(Functions::YueToLua); LUA->SetField(-2, "ToLua");
+#if IS_SERVERSIDE
+    LUA->PushCFunction(Functions::YueToLuaAsync); LUA->SetField(-2, "ToLuaAsync");
+#endif
     LUA->SetField(-2, "yue");
 
 #if IS_SERVERSIDE
+    LUA->PushCFunction(Functions::ToLuaAsync); LUA->SetField(-2, "ToLuaAsync");
     LUA->PushCFunction(Functions::PreCacheDir); LUA->SetField(-2, "PreCacheDir");
     LUA->PushCFunction(Functions::PreCacheFile); LUA->SetField(-2, "PreCacheFile");
 #endif
@@ -250,10 +386,47 @@ void LuaAPI::Initialize(GarrysMod::Lua::ILuaInterface* LUA) {
 void LuaAPI::Deinitialize() {
 #if IS_SERVERSIDE
     AddCSLuaFile_ref.Free();
+
+    // Unfinished compilations are left to the engine pool, nobody will receive them
+    if (core && core->LUA)
+        for (auto& task : async_tasks) core->LUA->ReferenceFree(task.callback_ref);
+    async_tasks.clear();
 #endif
 }
 
 #if IS_SERVERSIDE
+void LuaAPI::AddAsyncTask(std::future<AsyncResult> result, int callback_ref) {
+    async_tasks.push_back({std::move(result), callback_ref});
+}
+
+void LuaAPI::Think(GarrysMod::Lua::ILuaInterface* LUA) {
+    for (auto it = async_tasks.begin(); it != async_tasks.end();) {
+        if (it->result.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            ++it;
+            continue;
+        }
+
+        // Task is removed before the callback, so it can start new compilations
+        auto task = std::move(*it);
+        it = async_tasks.erase(it);
+
+        LUA->ReferencePush(task.callback_ref);
+        LUA->ReferenceFree(task.callback_ref);
+        int args = 0;
+        try {
+            args = task.result.get()(LUA);
+        } catch (const std::exception& e) {
+            LUA->PushNil();
+            Utils::PushString(LUA, e.what());
+            args = 2;
+        }
+        if (LUA->PCall(args, 0, 0) != 0) {
+            LUA->ErrorNoHalt("[Moonloader] Error in async compile callback: %s\n", LUA->GetString(-1));
+            LUA->Pop();
+        }
+    }
+}
+
 void LuaAPI::AddCSLuaFile(GarrysMod::Lua::ILuaInterface* LUA) {
     AddCSLuaFile_ref.Push();
     if (!LUA->IsType(1, GarrysMod::Lua::Type::String)) {
@@ -275,15 +448,34 @@ bool LuaAPI::PreCacheFile(GarrysMod::Lua::ILuaInterface* LUA, const std::string&
     return core->compiler->CompileFile(path);
 }
 
-void LuaAPI::PreCacheDir(GarrysMod::Lua::ILuaInterface* LUA, const std::string& startPath) {
-    for (const auto [fileName, isDir] : core->fs->Find(Utils::Path::Join(startPath, "*"), LUA->GetPathID())) {
-        std::string path = Utils::Path::Join(startPath, fileName);
-        if (core->fs->IsDirectory(path, LUA->GetPathID())) {
-            PreCacheDir(LUA, path);
-        } else if (Utils::Path::Extension(path) == "moon" || Utils::Path::Extension(path) == "yue") {
-            PreCacheFile(LUA, path);
-        }
+int LuaAPI::PreCacheDir(GarrysMod::Lua::ILuaInterface* LUA, const std::string& startPath, int progressIndex) {
+    DevMsg("[Moonloader] Precaching %s\n", startPath.c_str());
+
+    Compiler::ProgressCallback progress;
+    if (progressIndex != 0) {
+        progress = [LUA, progressIndex](const std::string& path, bool success, size_t done, size_t total) {
+            LUA->Push(progressIndex);
+            Utils::PushString(LUA, path);
+            LUA->PushBool(success);
+            LUA->PushNumber(done);
+            LUA->PushNumber(total);
+            if (LUA->PCall(4, 0, 0) != 0) {
+                LUA->ErrorNoHalt("[Moonloader] Error in PreCacheDir progress callback: %s\n", LUA->GetString(-1));
+                LUA->Pop();
+            }
+        };
     }
+
+    auto summary = core->compiler->CompileDir(startPath, progress);
+    DevMsg("[Moonloader] Precached %zu files in %s (%zu failed) in %.1f ms\n", summary.files, startPath.c_str(), summary.failures, summary.time);
+
+    LUA->CreateTable();
+    LUA->PushNumber(summary.files); LUA->SetField(-2, "files");
+    LUA->PushNumber(summary.compiled); LUA->SetField(-2, "compiled");
+    LUA->PushNumber(summary.failures); LUA->SetField(-2, "failures");
+    LUA->PushNumber(summary.bytes); LUA->SetField(-2, "bytes");
+    LUA->PushNumber(summary.time); LUA->SetField(-2, "ms");
+    return 1;
 }
 
 inline void ModifyDebugInfo(GarrysMod::Lua::ILuaInterface* LUA, const Compiler::CompiledFile* info) {
@@ -349,5 +541,34 @@ int LuaAPI::DebugGetInfo(GarrysMod::Lua::ILuaInterface* LUA) {
     }
     return 1;
 }
+
+std::optional<std::string> LuaAPI::FindCallingFile(GarrysMod::Lua::ILuaInterface* LUA) {
+    if (!GetInfo_ref) return std::nullopt;
+
+    // First levels are C functions, like include itself
+    for (int level = 1; level <= 8; level++) {
+        GetInfo_ref.Push();
+        LUA->PushNumber(level);
+        LUA->PushString("S");
+        if (LUA->PCall(2, 1, 0) != 0 || !LUA->IsType(-1, GarrysMod::Lua::Type::Table)) {
+            LUA->Pop();
+            return std::nullopt;
+        }
+
+        LUA->GetField(-1, "source");
+        auto source = Utils::GetString(LUA, -1);
+        if (!Utils::StartsWith(source, "@")) {
+            LUA->Pop(2);
+            continue;
+        }
+
+        std::optional<std::string> path;
+        if (auto info = core->compiler->FindFileByFullOutputPath(source.substr(1)))
+            path = info->source_path;
+        LUA->Pop(2);
+        return path;
+    }
+    return std::nullopt;
+}
 #endif
 
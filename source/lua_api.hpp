@@ -3,6 +3,12 @@
 
 #include <GarrysMod/Lua/LuaInterface.h>
 #include <memory>
+#include <string>
+#include <vector>
+#include <list>
+#include <optional>
+#include <future>
+#include <functional>
 
 #if IS_SERVERSIDE
 #include <GarrysMod/Lua/AutoReference.h>
@@ -12,10 +18,21 @@ namespace MoonLoader {
     class Core;
 
     class LuaAPI {
+    public:
+        // Made by worker thread, pushes callback arguments on the game thread and returns their count
+        typedef std::function<int(GarrysMod::Lua::ILuaBase*)> AsyncResult;
+
+    private:
         std::shared_ptr<Core> core;
     #if IS_SERVERSIDE
         GarrysMod::Lua::AutoReference AddCSLuaFile_ref;
         GarrysMod::Lua::AutoReference GetInfo_ref;
+
+        struct AsyncTask {
+            std::future<AsyncResult> result;
+            int callback_ref;
+        };
+        std::list<AsyncTask> async_tasks;
     #endif
 
     public:
@@ -28,8 +45,16 @@ namespace MoonLoader {
         void BeginVersionCheck(GarrysMod::Lua::ILuaInterface* LUA);
         void AddCSLuaFile(GarrysMod::Lua::ILuaInterface* LUA);
         bool PreCacheFile(GarrysMod::Lua::ILuaInterface* LUA, const std::string& path);
-        void PreCacheDir(GarrysMod::Lua::ILuaInterface* LUA, const std::string& startPath);
+        // Pushes summary table, progress callback is called at given stack index if it isn't 0
+        int PreCacheDir(GarrysMod::Lua::ILuaInterface* LUA, const std::string& startPath, int progressIndex = 0);
         int DebugGetInfo(GarrysMod::Lua::ILuaInterface* LUA);
+        // Source path of compiled file which runs the closest lua function of the stack
+        std::optional<std::string> FindCallingFile(GarrysMod::Lua::ILuaInterface* LUA);
+
+        // Callback is a lua reference, it is freed after the call
+        void AddAsyncTask(std::future<AsyncResult> result, int callback_ref);
+        // Calls callbacks of finished async compilations, must be called from game thread
+        void Think(GarrysMod::Lua::ILuaInterface* LUA);
     #endif
     };
 }
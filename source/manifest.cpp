@@ -0,0 +1,99 @@
+#include "manifest.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace MoonLoader;
+
+namespace {
+    constexpr std::string_view HEADER = "moonloader-manifest 1";
+
+    // Splits by separator, empty fields are kept
+    std::vector<std::string_view> Split(std::string_view str, char separator) {
+        std::vector<std::string_view> parts;
+        size_t last = 0;
+        while (true) {
+            size_t next = str.find(separator, last);
+            parts.push_back(str.substr(last, next == std::string_view::npos ? std::string_view::npos : next - last));
+            if (next == std::string_view::npos) break;
+            last = next + 1;
+        }
+        return parts;
+    }
+
+    bool ParseNumber(std::string_view str, int base, uint64_t& value) {
+        if (str.empty()) return false;
+        std::string copy(str);
+        char* end = nullptr;
+        value = std::strtoull(copy.c_str(), &end, base);
+        return end == copy.c_str() + copy.size();
+    }
+}
+
+std::string Manifest::Serialize(const std::vector<Entry>& entries) {
+    std::string result(HEADER);
+    result += '\n';
+
+    char buffer[64];
+    for (const auto& entry : entries) {
+        // Such paths can't be stored, their files are simply compiled on the server
+        if (entry.source_path.find_first_of("\t\r\n") != std::string::npos) continue;
+
+        result += entry.source_path;
+        result += entry.source_key.language == CompileCache::Language::Yuescript ? "\ty\t" : "\tm\t";
+        snprintf(buffer, sizeof(buffer), "%016llx\t%zu\t%016llx\t",
+            static_cast<unsigned long long>(entry.source_key.hash), entry.source_key.size,
+            static_cast<unsigned long long>(entry.output_hash));
+        result += buffer;
+
+        bool first = true;
+        for (const auto& [lua_line, source_line] : entry.line_map) {
+            snprintf(buffer, sizeof(buffer), "%s%d:%d", first ? "" : " ", lua_line, source_line);
+            result += buffer;
+            first = false;
+        }
+        result += '\n';
+    }
+    return result;
+}
+
+std::vector<Manifest::Entry> Manifest::Parse(std::string_view text) {
+    std::vector<Entry> entries;
+    auto lines = Split(text, '\n');
+    if (lines.empty() || lines[0] != HEADER) return entries;
+
+    for (size_t i = 1; i < lines.size(); i++) {
+        auto fields = Split(lines[i], '\t');
+        if (fields.size() != 6 || fields[0].empty()) continue;
+
+        Entry entry;
+        entry.source_path = fields[0];
+        if (fields[1] == "y") entry.source_key.language = CompileCache::Language::Yuescript;
+        else if (fields[1] == "m") entry.source_key.language = CompileCache::Language::Moonscript;
+        else continue;
+
+        uint64_t size = 0;
+        if (!ParseNumber(fields[2], 16, entry.source_key.hash)
+            || !ParseNumber(fields[3], 10, size)
+            || !ParseNumber(fields[4], 16, entry.output_hash))
+            continue;
+        entry.source_key.size = static_cast<size_t>(size);
+
+        bool valid = true;
+        if (!fields[5].empty()) {
+            for (auto pair : Split(fields[5], ' ')) {
+                size_t colon = pair.find(':');
+                uint64_t lua_line = 0, source_line = 0;
+                if (colon == std::string_view::npos
+                    || !ParseNumber(pair.substr(0, colon), 10, lua_line)
+                    || !ParseNumber(pair.substr(colon + 1), 10, source_line)) {
+                    valid = false;
+                    break;
+                }
+                entry.line_map[static_cast<int>(lua_line)] = static_cast<int>(source_line);
+            }
+        }
+        if (valid) entries.push_back(std::move(entry));
+    }
+    return entries;
+}
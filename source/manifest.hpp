@@ -0,0 +1,33 @@
+#ifndef MOONLOADER_MANIFEST_HPP
+#define MOONLOADER_MANIFEST_HPP
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "compile_cache.hpp"
+
+// Manifest of files compiled by moonloader-precompile, shared by the module and the tool,
+// so it must not depend on Garry's Mod headers
+namespace MoonLoader::Manifest {
+    // Written into root of output directory, next to compiled files
+    constexpr const char* FILE_NAME = "moonloader.manifest";
+
+    struct Entry {
+        std::string source_path; // Relative to lua directory
+        CompileCache::Key source_key; // Same key Compiler computes, output is trusted while it matches
+        uint64_t output_hash = 0;
+        std::map<int, int> line_map; // lua line -> source line
+    };
+
+    // One line per entry, fields are separated by tabs
+    std::string Serialize(const std::vector<Entry>& entries);
+    // Malformed lines are skipped, manifest of another version is ignored completely
+    std::vector<Entry> Parse(std::string_view text);
+}
+
+#endif // MOONLOADER_MANIFEST_HPP
@@ -0,0 +1,33 @@
+#ifndef MOONLOADER_RELOAD_PLAN_HPP
+#define MOONLOADER_RELOAD_PLAN_HPP
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+
+#include "compile_cache.hpp"
+
+// What auto-reload does after a changed source was compiled again. Shared by the watchdog and tests,
+// so it must not depend on Garry's Mod headers
+namespace MoonLoader {
+    struct ReloadPlan {
+        bool refresh_source = false; // Output changed, so the engine has to load it again
+        bool recompile_dependents = false; // Files importing the source may expand different macros now
+
+        // previous_key is empty when the source wasn't compiled before
+        static ReloadPlan Make(const std::optional<CompileCache::Key>& previous_key, uint64_t previous_output_hash,
+                               const CompileCache::Key& key, uint64_t output_hash) {
+            ReloadPlan plan;
+            plan.refresh_source = output_hash != previous_output_hash;
+            // Module which only defines macros compiles into the same lua when their bodies are edited
+            plan.recompile_dependents = !previous_key || !(*previous_key == key);
+            return plan;
+        }
+
+        // Content didn't change, e.g. file was only touched
+        bool Empty() const { return !refresh_source && !recompile_dependents; }
+    };
+}
+
+#endif // MOONLOADER_RELOAD_PLAN_HPP
@@ -5,9 +5,12 @@
 #include "utils.hpp"
 #include "core.hpp"
 #include "config.hpp"
+#include "reload_plan.hpp"
 
 #include <tier0/dbg.h>
+#include <tier0/icommandline.h>
 #include <chrono>
+#include <algorithm>
 #include <GarrysMod/Lua/LuaInterface.h>
 #include <GarrysMod/Lua/LuaShared.h>
 #include <GarrysMod/FunctionPointers.hpp>
@@ -75,12 +78,13 @@ void WatchdogListener::handleFileAction(efsw::WatchID watchid, const std::string
     const std::string& filename, efsw::Action action,
     std::string oldFilename
 ) {
-    // We only care about modified files
-    if (action == efsw::Actions::Modified) {
-        std::string path = Utils::Path::Join(dir + filename);
-        if (auto watchdog = this->watchdog.lock())
-            watchdog->OnFileModified(path);
-    }
+    auto watchdog = this->watchdog.lock();
+    if (!watchdog) return;
+
+    // Only modified files are autorefreshed, but editors which save through rename
+    // add or move files, which makes compiled files stale too
+    std::string path = Utils::Path::Join(dir + filename);
+    watchdog->OnFileModified(path, action == efsw::Actions::Modified);
 }
 
 Watchdog::Watchdog(std::shared_ptr<Core> core, std::shared_ptr<Filesystem> fs) 
@@ -102,6 +106,8 @@ Watchdog::Watchdog(std::shared_ptr<Core> core, std::shared_ptr<Filesystem> fs)
     } else {
         core->LUA->ErrorNoHalt("[Moonloader] Too many functions were found for HandleFileChange signature! Autorefresh won't work properly.\n\tPlease, report to " MOONLOADER_URL "/issues\n");
     }
+
+    m_Active = m_HandleFileChangeHook->IsValid() && !CommandLine()->FindParm("-disableluarefresh");
 }
 
 void Watchdog::Start() {
@@ -113,7 +119,7 @@ Watchdog::~Watchdog() {
     m_HandleFileChangeHook->Disable();
 }
 
-void Watchdog::OnFileModified(const std::string& path) {
+void Watchdog::OnFileModified(const std::string& path, bool refresh) {
     // We only care about file we are watching
     std::string relativePath = fs->FullToRelativePath(path, core->LUA->GetPathID());
     Utils::Path::Normalize(relativePath);
@@ -121,20 +127,38 @@ void Watchdog::OnFileModified(const std::string& path) {
     std::lock_guard<std::mutex> guard(m_Lock);
     if (!IsFileWatched(relativePath))
         return;
-    
+
+    m_DirtyFiles.insert(relativePath);
+
     // Add our modified file to the queue
-    m_ModifiedFiles.push(std::move(relativePath));
+    if (refresh)
+        m_ModifiedFiles.push(std::move(relativePath));
+}
+
+bool Watchdog::IsFileDirty(const std::string& path) {
+    std::lock_guard<std::mutex> guard(m_Lock);
+    return m_DirtyFiles.find(path) != m_DirtyFiles.end();
+}
+
+void Watchdog::ClearDirty(const std::string& path) {
+    std::lock_guard<std::mutex> guard(m_Lock);
+    m_DirtyFiles.erase(path);
 }
 
-void Watchdog::WatchDirectory(const std::string& path) {
+bool Watchdog::WatchDirectory(const std::string& path) {
     if (IsDirectoryWatched(path))
         // Our watchdog already registered here
-        return;
-
-    DevMsg("[Moonloader] Watching for directory %s\n", path.c_str());
+        return true;
 
     auto id = m_Watcher->addWatch(path.c_str(), m_WatchdogListener.get(), false);
+    if (id < 0) {
+        DevWarning("[Moonloader] Unable to watch directory %s: %s\n", path.c_str(), efsw::Errors::Log::getLastErrorLog().c_str());
+        return false;
+    }
+
+    DevMsg("[Moonloader] Watching for directory %s\n", path.c_str());
     m_WatchIDs.insert_or_assign(path, id);
+    return true;
 }
 
 void MoonLoader::Watchdog::WatchFile(const std::string& path, const char* pathID) {
@@ -150,8 +174,12 @@ void MoonLoader::Watchdog::WatchFile(const std::string& path, const char* pathID
         return;
     }
 
+    // Files of directories we can't watch are checked on the disk by compiler
+    if (!WatchDirectory(fullPath))
+        return;
+
     DevMsg("[Moonloader] Watching for file %s\n", path.c_str());
-    WatchDirectory(fullPath);
+    std::lock_guard<std::mutex> guard(m_Lock);
     m_WatchedFiles.insert(path.c_str());
 }
 
@@ -161,26 +189,75 @@ void Watchdog::Think() {
 
     auto currentTimestamp = Utils::Timestamp();
 
-    std::lock_guard<std::mutex> guard(m_Lock);
-    while (!m_ModifiedFiles.empty()) {
-        auto& path = m_ModifiedFiles.front();
+    // Compilation clears dirty marks, so the queue is taken out of the lock first
+    std::queue<std::string> modifiedFiles;
+    {
+        std::lock_guard<std::mutex> guard(m_Lock);
+        std::swap(modifiedFiles, m_ModifiedFiles);
+    }
+
+    while (!modifiedFiles.empty()) {
+        auto& path = modifiedFiles.front();
         auto timestamp = m_ModifiedFileDelays.find(path);
         // Check if modified file is delayed
         if (timestamp == m_ModifiedFileDelays.end() || (timestamp->second) < currentTimestamp) {
             DevMsg("[Moonloader] %s was updated. Triggering auto-reload...\n", path.c_str());
 
-            if (core->compiler->CompileFile(path, true)) {
-                if (auto file = GetCachedFile(path)) {
-                    RefreshFile(file->name);
+            auto previous = core->compiler->FindFileBySourcePath(path);
+            uint64_t previous_hash = previous ? previous->output_hash : 0;
+            std::optional<CompileCache::Key> previous_key;
+            if (previous) previous_key = previous->source_key;
+            // Only a small part of the file was edited, so parse trees of other statements are reused
+            if (core->compiler->CompileFile(path, true, true)) {
+                auto compiled = core->compiler->FindFileBySourcePath(path);
+                auto plan = compiled ? ReloadPlan::Make(previous_key, previous_hash, compiled->source_key, compiled->output_hash) : ReloadPlan();
+                if (compiled && plan.Empty()) {
+                    DevMsg("[Moonloader] %s is unchanged, skipping auto-reload\n", path.c_str());
                 } else {
-                    Warning("[Moonloader] Unable to find file %s in cache. Can't autorefresh it :(\n", path.c_str());
+                    // Macro modules are only imported, engine never loads them
+                    std::vector<std::string> dependents;
+                    if (!compiled || plan.recompile_dependents) dependents = core->compiler->FindDependents(path);
+                    if (!compiled || plan.refresh_source) RefreshSource(path, dependents.empty());
+                    RefreshDependents(path, dependents);
                 }
             }
 
             m_ModifiedFileDelays[path] = currentTimestamp + 200; // Add 200ms delay, before we can reload file again
         }
 
-        m_ModifiedFiles.pop();
+        modifiedFiles.pop();
+    }
+}
+
+bool Watchdog::RefreshSource(const std::string& path, bool warn) {
+    if (auto file = GetCachedFile(path)) {
+        RefreshFile(file->name);
+        return true;
+    }
+
+    if (warn)
+        Warning("[Moonloader] Unable to find file %s in cache. Can't autorefresh it :(\n", path.c_str());
+    return false;
+}
+
+void Watchdog::RefreshDependents(const std::string& path, const std::vector<std::string>& dependents) {
+    if (dependents.empty())
+        return;
+
+    std::vector<uint64_t> previous_hashes;
+    for (const auto& dependent : dependents) {
+        auto compiled = core->compiler->FindFileBySourcePath(dependent);
+        previous_hashes.push_back(compiled ? compiled->output_hash : 0);
+    }
+
+    // Imported sources are a part of source keys of files using their macros, so only those are compiled again
+    DevMsg("[Moonloader] Recompiling %zu files importing %s...\n", dependents.size(), path.c_str());
+    core->compiler->CompileFiles(dependents, true);
+
+    for (size_t i = 0; i < dependents.size(); i++) {
+        auto compiled = core->compiler->FindFileBySourcePath(dependents[i]);
+        if (compiled && compiled->output_hash != previous_hashes[i])
+            RefreshSource(dependents[i], false);
     }
 }
 
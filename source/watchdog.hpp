@@ -3,6 +3,7 @@
 
 #include <string>
 #include <string_view>
+#include <vector>
 #include <memory>
 #include <unordered_map>
 #include <unordered_set>
@@ -42,9 +43,11 @@ namespace MoonLoader {
         std::unordered_set<std::string> m_WatchedFiles;
         std::unordered_map<std::string, GarrysMod::Lua::File*> m_LuaFileCache; // Used for custom autorefresh
         std::unique_ptr<Detouring::Hook> m_HandleFileChangeHook;
+        bool m_Active = false; // Autorefresh can work, HandleFileChange is hooked and not disabled by launch options
 
         std::mutex m_Lock;
         std::queue<std::string> m_ModifiedFiles;
+        std::unordered_set<std::string> m_DirtyFiles; // Changed since they were compiled
         std::unordered_map<std::string, uint64> m_ModifiedFileDelays;
 
     public:
@@ -55,6 +58,7 @@ namespace MoonLoader {
 
         inline bool IsFileWatched(const std::string& path) { return m_WatchedFiles.find(path) != m_WatchedFiles.end(); }
         inline bool IsDirectoryWatched(const std::string& path) { return m_WatchIDs.find(path) != m_WatchIDs.end(); }
+        inline bool IsActive() const { return m_Active; }
 
         inline void CacheFile(const std::string& path, GarrysMod::Lua::File* file) { m_LuaFileCache.insert_or_assign(path, file); }
         inline GarrysMod::Lua::File* GetCachedFile(const std::string& path) {
@@ -62,16 +66,25 @@ namespace MoonLoader {
             return it != m_LuaFileCache.end() ? it->second : nullptr;
         }
 
-        void OnFileModified(const std::string& path);
+        // Called from watcher thread. Any change marks file dirty, only modifications trigger autorefresh
+        void OnFileModified(const std::string& path, bool refresh = true);
+
+        // Only changes of watched files are known, freshness of other files must be checked on the disk
+        bool IsFileDirty(const std::string& path);
+        void ClearDirty(const std::string& path);
 
         // Directory path must be absolute
-        void WatchDirectory(const std::string& path);
+        bool WatchDirectory(const std::string& path);
         void WatchFile(const std::string& path, const char* pathID);
         void Think();
 
         // Custom Autorefresh
         void HandleFileChange(const std::string& path);
         void RefreshFile(const std::string& path);
+        // Refreshes compiled file by its source path, returns false if it wasn't loaded by the engine
+        bool RefreshSource(const std::string& path, bool warn = true);
+        // Recompiles files importing given one (see Compiler::FindDependents), and refreshes those whose output changed
+        void RefreshDependents(const std::string& path, const std::vector<std::string>& dependents);
     };
 }
 
@@ -0,0 +1,293 @@
+#include "yuescript.hpp"
+#include "compile_cache.hpp"
+
+#include <string>
+#include <memory>
+#include <cctype>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <yuescript/yue_compiler.h>
+
+extern "C" {
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+int luaopen_yue(lua_State* L);
+int luaopen_bit32(lua_State* L);
+LUALIB_API void luaL_requiref (lua_State *L, const char *modname,
+                               lua_CFunction openf, int glb);
+} // extern "C"
+
+inline const luaL_Reg loadedlibs[] = {
+    {"_G", luaopen_base},
+    {LUA_LOADLIBNAME, luaopen_package},
+    //   {LUA_COLIBNAME, luaopen_coroutine},
+    {LUA_TABLIBNAME, luaopen_table},
+    //   {LUA_IOLIBNAME, luaopen_io},
+    //   {LUA_OSLIBNAME, luaopen_os},
+    {LUA_STRLIBNAME, luaopen_string},
+    {"bit", luaopen_bit32},
+    {LUA_MATHLIBNAME, luaopen_math},
+    {LUA_DBLIBNAME, luaopen_debug},
+    {"yue", luaopen_yue},
+    {NULL, NULL}
+};
+
+using namespace MoonLoader;
+
+void Yuescript::OpenLibs(void* state) {
+    lua_State* L = static_cast<lua_State*>(state);
+    const luaL_Reg *lib;
+    /* call open functions from 'loadedlibs' and set results to global table */
+    for (lib = loadedlibs; lib->func; lib++) {
+        luaL_requiref(L, lib->name, lib->func, 1);
+        lua_pop(L, 1);  /* remove lib */
+    }
+}
+
+namespace {
+    // Compiler is rebuilt after this many compilations with macros, in case they changed something we can't clean
+    constexpr size_t RECYCLE_INTERVAL = 256;
+
+    // Code hashes of sources seen by HashImports. Compiler keeps macros of imported modules for its whole life,
+    // so a changed import starts a new generation, and compilers of all threads are rebuilt before their next macros
+    std::mutex g_ImportsLock;
+    std::unordered_map<std::string, uint64_t> g_ImportHashes;
+    std::atomic<uint64_t> g_ImportsGeneration = 0;
+
+    void NoteImport(const std::string& path, uint64_t hash) {
+        std::lock_guard<std::mutex> guard(g_ImportsLock);
+        auto [it, inserted] = g_ImportHashes.try_emplace(path, hash);
+        if (!inserted && it->second != hash) {
+            it->second = hash;
+            g_ImportsGeneration++;
+        }
+    }
+
+    // Copies keys of table at the top of the stack into a new table
+    void PushKeys(lua_State* L) {
+        lua_newtable(L);
+        lua_pushnil(L);
+        while (lua_next(L, -3) != 0) {
+            lua_pop(L, 1);
+            lua_pushvalue(L, -1);
+            lua_pushboolean(L, 1);
+            lua_rawset(L, -4);
+        }
+        lua_remove(L, -2);
+    }
+
+    // Removes fields of table at given index, which are not present in keys table at the top of the stack
+    void RemoveNewKeys(lua_State* L, int index) {
+        index = lua_absindex(L, index);
+        lua_pushnil(L);
+        while (lua_next(L, index) != 0) {
+            lua_pop(L, 1);
+            lua_pushvalue(L, -1);
+            lua_rawget(L, -3);
+            bool known = lua_toboolean(L, -1);
+            lua_pop(L, 1);
+            if (!known) {
+                // Clearing existing fields during traversal is allowed
+                lua_pushvalue(L, -1);
+                lua_pushnil(L);
+                lua_rawset(L, index);
+            }
+        }
+    }
+
+    class ThreadCompiler {
+        std::unique_ptr<yue::YueCompiler> m_Compiler;
+        // Owned by compiler, which creates it on the first macro and opens libraries through OpenLibs below.
+        // Stays null on threads which never compiled a macro
+        lua_State* L = nullptr;
+        int m_GlobalsRef = LUA_NOREF;
+        int m_LoadedRef = LUA_NOREF;
+        size_t m_MacroCompiles = 0;
+        uint64_t m_ImportsGeneration = 0;
+
+        void OpenLibs(void* state) {
+            Yuescript::OpenLibs(state);
+            L = static_cast<lua_State*>(state);
+
+            // Everything which exists now is ours, the rest was made by macros
+            lua_pushglobaltable(L);
+            PushKeys(L);
+            m_GlobalsRef = luaL_ref(L, LUA_REGISTRYINDEX);
+            lua_pop(L, 1);
+
+            luaL_getsubtable(L, LUA_REGISTRYINDEX, "_LOADED");
+            PushKeys(L);
+            m_LoadedRef = luaL_ref(L, LUA_REGISTRYINDEX);
+            lua_pop(L, 1);
+        }
+
+        // Removes globals and modules left by macros. Macros exported by imported modules are kept by compiler,
+        // it is rebuilt when they change (see g_ImportsGeneration)
+        void Reset() {
+            if (!L) return;
+            lua_settop(L, 0);
+
+            lua_pushglobaltable(L);
+            lua_rawgeti(L, LUA_REGISTRYINDEX, m_GlobalsRef);
+            RemoveNewKeys(L, -2);
+            lua_pop(L, 2);
+
+            luaL_getsubtable(L, LUA_REGISTRYINDEX, "_LOADED");
+            lua_rawgeti(L, LUA_REGISTRYINDEX, m_LoadedRef);
+            RemoveNewKeys(L, -2);
+            lua_pop(L, 2);
+        }
+
+        void Recycle() {
+            m_Compiler.reset();
+            L = nullptr;
+            m_GlobalsRef = m_LoadedRef = LUA_NOREF;
+            m_MacroCompiles = 0;
+        }
+
+    public:
+        yue::CompileInfo Compile(std::string_view code, const yue::YueConfig& config) {
+            bool macros = Yuescript::MayUseMacros(code);
+            uint64_t generation = g_ImportsGeneration;
+            if (!m_Compiler || (macros && (m_MacroCompiles >= RECYCLE_INTERVAL || m_ImportsGeneration != generation))) {
+                Recycle();
+                m_Compiler = std::make_unique<yue::YueCompiler>(nullptr, [this](void* state) { OpenLibs(state); });
+                m_ImportsGeneration = generation;
+            }
+
+            try {
+                auto info = m_Compiler->compile(code, config);
+                // Files without macros leave the state untouched
+                if (macros) {
+                    m_MacroCompiles++;
+                    Reset();
+                }
+                return info;
+            } catch (...) {
+                Recycle();
+                throw;
+            }
+        }
+    };
+}
+
+bool Yuescript::MayUseMacros(std::string_view code) {
+    if (code.find('$') != std::string_view::npos) return true;
+    for (size_t pos = code.find("macro"); pos != std::string_view::npos; pos = code.find("macro", pos + 1)) {
+        bool word_start = pos == 0 || !(isalnum(static_cast<unsigned char>(code[pos - 1])) || code[pos - 1] == '_');
+        size_t end = pos + 5;
+        bool word_end = end == code.size() || !(isalnum(static_cast<unsigned char>(code[end])) || code[end] == '_');
+        if (word_start && word_end) return true;
+    }
+    return false;
+}
+
+yue::CompileInfo Yuescript::Compile(std::string_view code, const yue::YueConfig& config) {
+    thread_local ThreadCompiler compiler;
+    return compiler.Compile(code, config);
+}
+
+void Yuescript::DefaultConfig(yue::YueConfig& config) {
+    config.options["target"] = "5.2";
+}
+
+namespace {
+    inline bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    // Source line of "-- N" at the end of a line, 0 if there is none
+    int ParseLineComment(std::string_view line) {
+        size_t end = line.size();
+        while (end > 0 && IsSpace(line[end - 1])) end--;
+
+        size_t start = end;
+        while (start > 0 && start + 9 > end && line[start - 1] >= '0' && line[start - 1] <= '9') start--;
+        if (start == end) return 0;
+
+        size_t dashes = start;
+        while (dashes > 0 && IsSpace(line[dashes - 1])) dashes--;
+        if (dashes < 2 || line[dashes - 1] != '-' || line[dashes - 2] != '-') return 0;
+
+        int source_line = 0;
+        for (size_t i = start; i < end; i++)
+            source_line = source_line * 10 + (line[i] - '0');
+        return source_line;
+    }
+}
+
+std::vector<int> Yuescript::ParseLines(std::string_view code) {
+    std::vector<int> lines;
+    lines.reserve(code.size() / 32 + 2);
+    lines.push_back(0); // Lua lines start from 1
+
+    size_t last = 0;
+    while (true) {
+        size_t next = code.find('\n', last);
+        size_t end = next == std::string_view::npos ? code.size() : next;
+        lines.push_back(ParseLineComment(code.substr(last, end - last)));
+        if (next == std::string_view::npos) break;
+        last = next + 1;
+    }
+    return lines;
+}
+
+std::vector<std::string> Yuescript::ParseImports(std::string_view code) {
+    std::vector<std::string> modules;
+    size_t last = 0;
+    while (last < code.size()) {
+        size_t next = code.find('\n', last);
+        size_t end = next == std::string_view::npos ? code.size() : next;
+        std::string_view line = code.substr(last, end - last);
+        last = end + 1;
+
+        size_t start = 0;
+        while (start < line.size() && IsSpace(line[start])) start++;
+        line.remove_prefix(start);
+        if (line.substr(0, 6) != "import" || (line.size() > 6 && (isalnum(static_cast<unsigned char>(line[6])) || line[6] == '_')))
+            continue;
+
+        // First string literal is the module, both in import "module" and import a from "module"
+        size_t open = line.find_first_of("\"'", 6);
+        if (open == std::string_view::npos) continue;
+        size_t close = line.find(line[open], open + 1);
+        if (close == std::string_view::npos) continue;
+
+        std::string_view module = line.substr(open + 1, close - open - 1);
+        if (!module.empty() && module.find("#{") == std::string_view::npos)
+            modules.emplace_back(module);
+    }
+    return modules;
+}
+
+std::vector<std::string> Yuescript::ResolveImports(const std::string& path, std::string_view code, const std::function<bool(const std::string&)>& exists) {
+    std::vector<std::string> imports;
+    for (const auto& module : ParseImports(code)) {
+        std::string base = module;
+        std::replace(base.begin(), base.end(), '.', '/');
+        for (const char* extension : {".yue", ".moon"}) {
+            std::string import_path = base + extension;
+            if (import_path != path && exists(import_path))
+                imports.push_back(std::move(import_path));
+        }
+    }
+    return imports;
+}
+
+uint64_t Yuescript::HashImports(const std::string& path, std::string_view code,
+    const std::function<bool(const std::string&)>& exists, const std::function<std::string(const std::string&)>& read,
+    std::unordered_set<std::string>& visited, uint64_t seed) {
+    for (const auto& import_path : ResolveImports(path, code, exists)) {
+        if (!visited.insert(import_path).second) continue;
+
+        // Macro modules can import macros of other modules
+        auto import_code = read(import_path);
+        NoteImport(import_path, CompileCache::Hash(import_code));
+        seed = CompileCache::Hash(import_code, CompileCache::Hash(import_path, seed));
+        seed = HashImports(import_path, import_code, exists, read, visited, seed);
+    }
+    return seed;
+}
@@ -0,0 +1,55 @@
+#ifndef MOONLOADER_YUESCRIPT_HPP
+#define MOONLOADER_YUESCRIPT_HPP
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <unordered_set>
+
+namespace yue {
+    struct YueConfig;
+    struct CompileInfo;
+}
+
+// Yuescript helpers shared by the module and moonloader-precompile,
+// so they must not depend on Garry's Mod headers
+namespace MoonLoader::Yuescript {
+    // Opens libraries of macro lua state, passed to yue::YueCompiler
+    void OpenLibs(void* state);
+
+    // Default compiler config, LuaJIT is 5.2 compat
+    void DefaultConfig(yue::YueConfig& config);
+
+    // Macros are defined with "macro" and used or imported with "$", code without both never needs macro state.
+    // False positives (e.g. "$" in a string) only cost a cleanup of the state or a missed cache hit
+    bool MayUseMacros(std::string_view code);
+
+    // Compiles with compiler of the current thread, which is reused between compilations.
+    // Macro lua state is created on the first macro of the thread and cleaned from modules and globals
+    // after every compilation with macros, files without them never touch lua.
+    yue::CompileInfo Compile(std::string_view code, const yue::YueConfig& config);
+
+    // Collects "-- N" line comments of compiled code (reserveLineNumber) in a single pass.
+    // Indexed by lua line, 0 means the line has no comment (index 0 is unused)
+    std::vector<int> ParseLines(std::string_view code);
+
+    // Module names of "import" statements with string literals (e.g. import "macros" as {$log}).
+    // Only statements fitting into one line are found
+    std::vector<std::string> ParseImports(std::string_view code);
+
+    // Existing sources (e.g. "macros.yue") of modules imported by code of given source
+    std::vector<std::string> ResolveImports(const std::string& path, std::string_view code, const std::function<bool(const std::string&)>& exists);
+
+    // Hash of imported sources and their own imports, every source is hashed once.
+    // Compiler and moonloader-precompile must agree on it, since keys of precompiled files are compared.
+    // When an import changed since it was hashed last time, Compile of every thread loads macro modules again
+    uint64_t HashImports(const std::string& path, std::string_view code,
+        const std::function<bool(const std::string&)>& exists, const std::function<std::string(const std::string&)>& read,
+        std::unordered_set<std::string>& visited, uint64_t seed);
+}
+
+#endif // MOONLOADER_YUESCRIPT_HPP
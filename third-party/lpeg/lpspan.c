@@ -0,0 +1,210 @@
+/*
+** $Id: lpspan.c $
+** Copyright 2007, Lua.org & PUC-Rio  (see 'lpeg.html' for license)
+*/
+
+#include "lptypes.h"
+#include "lpspan.h"
+
+
+/*
+** Number of chars tested one by one before trying vector code. Most
+** spans (identifiers, indentation) are shorter than this, and building
+** the lookup tables is not free.
+*/
+#if !defined(SPANSCALAR)
+#define SPANSCALAR	16
+#endif
+
+
+#if defined(LPEG_SIMD) && (defined(__x86_64__) || defined(__i386__) || \
+                           defined(_M_X64) || defined(_M_IX86))
+#define SPAN_X86
+#endif
+
+
+#if defined(SPAN_X86)
+
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET(t)	/* empty */
+static int firstbit (unsigned int m) {
+  unsigned long i;
+  _BitScanForward(&i, m);
+  return (int)i;
+}
+#else
+#define TARGET(t)	__attribute__((target(t)))
+#define firstbit(m)	__builtin_ctz(m)
+#endif
+
+
+/* keeps bits 0, 2, 4, ..., 14 of 'm', packed into a byte */
+static byte evenbits (unsigned int m) {
+  m &= 0x5555;
+  m = (m | (m >> 1)) & 0x3333;
+  m = (m | (m >> 2)) & 0x0F0F;
+  m = (m | (m >> 4)) & 0x00FF;
+  return (byte)m;
+}
+
+
+/*
+** Transposes charset into two nibble tables: bit 'h' of 'low[n]' tells
+** whether char (h << 4 | n) is in the set, for h in 0-7; 'high' does
+** the same for h in 8-15. Byte 'k' of each charset half holds chars
+** 8k to 8k + 7, so walking bits from 7 down to 0 with 'movemask' gives
+** one bit of every byte at a time.
+*/
+TARGET("ssse3")
+static void buildtables (const byte *cs, byte *low, byte *high) {
+  __m128i v0 = _mm_loadu_si128((const __m128i *)cs);
+  __m128i v1 = _mm_loadu_si128((const __m128i *)(cs + 16));
+  int b;
+  for (b = 7; b >= 0; b--) {
+    unsigned int m0 = (unsigned int)_mm_movemask_epi8(v0);
+    unsigned int m1 = (unsigned int)_mm_movemask_epi8(v1);
+    low[b] = evenbits(m0); low[8 + b] = evenbits(m0 >> 1);
+    high[b] = evenbits(m1); high[8 + b] = evenbits(m1 >> 1);
+    v0 = _mm_add_epi8(v0, v0);  /* next bit goes to the top */
+    v1 = _mm_add_epi8(v1, v1);
+  }
+}
+
+
+/*
+** Classifies 16 chars with two 'pshufb' lookups: low nibble selects the
+** table row, high nibble selects the bit in that row.
+*/
+TARGET("ssse3")
+static const char *spanssse3 (const char *s, const char *e, const byte *cs) {
+  byte low[16], high[16];
+  __m128i lowt, hight, bits, nib, seven, zero;
+  buildtables(cs, low, high);
+  lowt = _mm_loadu_si128((const __m128i *)low);
+  hight = _mm_loadu_si128((const __m128i *)high);
+  bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                       1, 2, 4, 8, 16, 32, 64, -128);
+  nib = _mm_set1_epi8(0x0F);
+  seven = _mm_set1_epi8(7);
+  zero = _mm_setzero_si128();
+  for (; e - s >= 16; s += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)s);
+    __m128i lo = _mm_and_si128(v, nib);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nib);
+    __m128i sel = _mm_cmpgt_epi8(hi, seven);
+    __m128i row = _mm_or_si128(_mm_andnot_si128(sel, _mm_shuffle_epi8(lowt, lo)),
+                               _mm_and_si128(sel, _mm_shuffle_epi8(hight, lo)));
+    __m128i bit = _mm_shuffle_epi8(bits, hi);
+    __m128i miss = _mm_cmpeq_epi8(_mm_and_si128(row, bit), zero);
+    unsigned int m = (unsigned int)_mm_movemask_epi8(miss);
+    if (m != 0) return s + firstbit(m);
+  }
+  for (; s < e; s++)
+    if (!testchar(cs, (byte)*s)) break;
+  return s;
+}
+
+
+/* same as 'spanssse3', 32 chars at a time */
+TARGET("avx2")
+static const char *spanavx2 (const char *s, const char *e, const byte *cs) {
+  byte low[16], high[16];
+  __m256i lowt, hight, bits, nib, seven, zero;
+  buildtables(cs, low, high);
+  lowt = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)low));
+  hight = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)high));
+  bits = _mm256_broadcastsi128_si256(_mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                                   1, 2, 4, 8, 16, 32, 64, -128));
+  nib = _mm256_set1_epi8(0x0F);
+  seven = _mm256_set1_epi8(7);
+  zero = _mm256_setzero_si256();
+  for (; e - s >= 32; s += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)s);
+    __m256i lo = _mm256_and_si256(v, nib);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nib);
+    __m256i sel = _mm256_cmpgt_epi8(hi, seven);
+    __m256i row = _mm256_blendv_epi8(_mm256_shuffle_epi8(lowt, lo),
+                                     _mm256_shuffle_epi8(hight, lo), sel);
+    __m256i bit = _mm256_shuffle_epi8(bits, hi);
+    __m256i miss = _mm256_cmpeq_epi8(_mm256_and_si256(row, bit), zero);
+    unsigned int m = (unsigned int)_mm256_movemask_epi8(miss);
+    if (m != 0) return s + firstbit(m);
+  }
+  for (; s < e; s++)
+    if (!testchar(cs, (byte)*s)) break;
+  return s;
+}
+
+
+/* 0 = scalar only, 1 = SSSE3, 2 = AVX2 */
+static int detectsimd (void) {
+#if defined(_MSC_VER)
+  int info[4];
+  int level = 0;
+  __cpuid(info, 0);
+  if (info[0] >= 1) {
+    int ecx;
+    __cpuid(info, 1);
+    ecx = info[2];
+    if (ecx & (1 << 9)) level = 1;  /* SSSE3 */
+    /* AVX2 needs OS support for ymm registers (OSXSAVE + XCR0) */
+    if (level && (ecx & (1 << 27)) && (ecx & (1 << 28)) &&
+        (_xgetbv(0) & 6) == 6) {
+      __cpuid(info, 0);
+      if (info[0] >= 7) {
+        __cpuidex(info, 7, 0);
+        if (info[1] & (1 << 5)) level = 2;
+      }
+    }
+  }
+  return level;
+#else
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return 2;
+  if (__builtin_cpu_supports("ssse3")) return 1;
+  return 0;
+#endif
+}
+
+/*
+** Detection result, -1 until the first long span. Engines of a pool match
+** from several threads; every thread computes the same value, so relaxed
+** atomic accesses are enough.
+*/
+#if defined(_MSC_VER)
+static volatile long simdlevel = -1;
+#define loadlevel()	((int)_InterlockedCompareExchange(&simdlevel, -1, -1))
+#define storelevel(l)	_InterlockedExchange(&simdlevel, (long)(l))
+#else
+#include <stdatomic.h>
+static atomic_int simdlevel = -1;
+#define loadlevel()	atomic_load_explicit(&simdlevel, memory_order_relaxed)
+#define storelevel(l)	atomic_store_explicit(&simdlevel, (l), memory_order_relaxed)
+#endif
+
+#endif
+
+
+const char *spanset (const char *s, const char *e, const byte *cs) {
+  const char *lim = (e - s > SPANSCALAR) ? s + SPANSCALAR : e;
+  for (; s < lim; s++)
+    if (!testchar(cs, (byte)*s)) return s;
+#if defined(SPAN_X86)
+  if (e - s >= 16) {
+    int level = loadlevel();
+    if (level < 0) {
+      level = detectsimd();
+      storelevel(level);
+    }
+    if (level == 2 && e - s >= 32) return spanavx2(s, e, cs);
+    if (level >= 1) return spanssse3(s, e, cs);
+  }
+#endif
+  for (; s < e; s++)
+    if (!testchar(cs, (byte)*s)) break;
+  return s;
+}
+
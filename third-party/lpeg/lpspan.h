@@ -0,0 +1,19 @@
+/*
+** $Id: lpspan.h $
+*/
+
+#if !defined(lpspan_h)
+#define lpspan_h
+
+#include "lptypes.h"
+
+
+/*
+** Returns first position in [s, e) whose char is not in charset 'cs'
+** (or 'e' if all chars are in the set). With LPEG_SIMD, long runs are
+** matched 16/32 chars at a time when the CPU supports SSSE3/AVX2.
+*/
+const char *spanset (const char *s, const char *e, const byte *cs);
+
+#endif
+
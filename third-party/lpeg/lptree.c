@@ -1196,6 +1196,33 @@ static int lp_setmax (lua_State *L) {
 }
 
 
+/*
+** Turns packrat mode on or off: results of grammar rules are kept by
+** (rule, position), so backtracking never matches the same rule twice
+** at the same place (while no match-time capture changes grammar state).
+** In tracked mode, grammar state changes only by 'lpeg.flushmemo'
+*/
+static int lp_setmemo (lua_State *L) {
+  luaL_checkany(L, 1);
+  lua_pushinteger(L, !lua_toboolean(L, 1) ? 0 : lua_toboolean(L, 2) ? 2 : 1);
+  lua_setfield(L, LUA_REGISTRYINDEX, MEMOIDX);
+  return 0;
+}
+
+
+/*
+** Tells matches in tracked packrat mode that grammar state has changed,
+** so results remembered so far can't be used
+*/
+static int lp_flushmemo (lua_State *L) {
+  lua_getfield(L, LUA_REGISTRYINDEX, MEMOSTATEIDX);
+  lua_pushinteger(L, lua_tointeger(L, -1) + 1);
+  lua_setfield(L, LUA_REGISTRYINDEX, MEMOSTATEIDX);
+  lua_pop(L, 1);
+  return 0;
+}
+
+
 static int lp_version (lua_State *L) {
   lua_pushstring(L, VERSION);
   return 1;
@@ -1273,6 +1300,8 @@ static struct luaL_Reg pattreg[] = {
   {"locale", lp_locale},
   {"version", lp_version},
   {"setmaxstack", lp_setmax},
+  {"setmemo", lp_setmemo},
+  {"flushmemo", lp_flushmemo},
   {"type", lp_type},
   {NULL, NULL}
 };
@@ -20,6 +20,8 @@
 
 #define PATTERN_T	"lpeg-pattern"
 #define MAXSTACKIDX	"lpeg-maxstack"
+#define MEMOIDX		"lpeg-memo"
+#define MEMOSTATEIDX	"lpeg-memo-state"
 
 
 /*
@@ -77,6 +79,10 @@
 /* index, on Lua stack, for backtracking stack */
 #define stackidx(ptop)	((ptop) + 4)
 
+/* indices, on Lua stack, for memo table and its captures (nil if off) */
+#define memoidx(ptop)		((ptop) + 5)
+#define memocapidx(ptop)	((ptop) + 6)
+
 
 
 typedef unsigned char byte;
@@ -14,6 +14,7 @@
 #include "lptypes.h"
 #include "lpvm.h"
 #include "lpprint.h"
+#include "lpspan.h"
 
 
 /* initial size for call/backtrack stack */
@@ -37,7 +38,9 @@ static const Instruction giveup = {{IGiveup, 0, 0}};
 typedef struct Stack {
   const char *s;  /* saved position (or NULL for calls) */
   const Instruction *p;  /* next instruction */
+  const char *callpos;  /* position where rule was called (calls only) */
   int caplevel;
+  unsigned int stamp;  /* memo stamp when rule was called (calls only) */
 } Stack;
 
 
@@ -94,6 +97,191 @@ static Stack *doublestack (lua_State *L, Stack **stacklimit, int ptop) {
 }
 
 
+/*
+** {======================================================
+** Memoization (packrat mode, see 'lpeg.setmemo')
+** =======================================================
+*/
+
+/* initial and maximum number of slots in memo table */
+#define MEMOINITSIZE	256
+#if !defined(MEMOMAXSIZE)
+#define MEMOMAXSIZE	(1 << 18)
+#endif
+
+/* maximum number of captures kept by memo entries */
+#if !defined(MEMOMAXCAPS)
+#define MEMOMAXCAPS	(1 << 18)
+#endif
+
+
+/*
+** Result of calling rule at a given position. Entries are valid only
+** while 'epoch' equals the current memo epoch: match-time captures can
+** run arbitrary code (and change whatever state the grammar depends
+** on), so each one starts a new epoch, and rules that ran one are not
+** memoized at all. In tracked mode only captures that called
+** 'lpeg.flushmemo' start a new epoch. Stale entries count as empty slots.
+*/
+typedef struct MemoEntry {
+  int rule;  /* rule code offset */
+  int s;  /* subject offset where rule was called */
+  int e;  /* subject offset at rule end, or -1 if rule failed */
+  unsigned int epoch;
+  int cap;  /* index of first capture in capture pool */
+  int ncap;  /* number of captures produced by rule */
+} MemoEntry;
+
+
+typedef struct Memo {
+  MemoEntry *entries;  /* open addressing table (NULL if off) */
+  int size;  /* number of slots (power of 2) */
+  int n;  /* number of live entries */
+  Capture *caps;  /* capture pool */
+  int capsize;
+  int ncaps;
+  unsigned int epoch;
+  unsigned int stamp;  /* changes with epoch and when rules can't be saved */
+  int tracked;  /* state changes are told by 'lpeg.flushmemo'? */
+  lua_Integer state;  /* state counter seen by last check (tracked mode) */
+} Memo;
+
+
+#define memohash(m,rule,s)	((((unsigned int)(rule) * 2654435761u) ^ \
+                                  (unsigned int)(s)) & ((m)->size - 1))
+
+/* rule called by the 'ICall' instruction with return address 'ret' */
+#define calltarget(ret)	((ret) - 2 + getoffset((ret) - 2))
+
+
+static lua_Integer memostate (lua_State *L) {
+  lua_Integer state;
+  lua_getfield(L, LUA_REGISTRYINDEX, MEMOSTATEIDX);
+  state = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  return state;
+}
+
+
+static void memoinit (lua_State *L, Memo *m) {
+  lua_Integer mode;
+  m->entries = NULL; m->caps = NULL;
+  m->size = m->n = m->capsize = m->ncaps = 0;
+  m->epoch = m->stamp = 0;
+  lua_getfield(L, LUA_REGISTRYINDEX, MEMOIDX);
+  mode = lua_tointeger(L, -1);  /* 0 off, 1 on, 2 tracked */
+  lua_pop(L, 1);
+  m->tracked = (mode == 2);
+  m->state = m->tracked ? memostate(L) : 0;
+  if (mode == 0) {
+    lua_pushnil(L); lua_pushnil(L);
+    return;
+  }
+  m->size = MEMOINITSIZE;
+  m->entries = (MemoEntry *)lua_newuserdata(L, m->size * sizeof(MemoEntry));
+  memset(m->entries, 0, m->size * sizeof(MemoEntry));
+  m->capsize = INITCAPSIZE;
+  m->caps = (Capture *)lua_newuserdata(L, m->capsize * sizeof(Capture));
+  m->epoch = 1;
+}
+
+
+/* invalidate all entries */
+static void memoflush (Memo *m) {
+  m->epoch++;
+  m->stamp++;
+  m->n = 0;
+  m->ncaps = 0;
+}
+
+
+static MemoEntry *memofind (Memo *m, int rule, int s) {
+  unsigned int i = memohash(m, rule, s);
+  for (;; i = (i + 1) & (m->size - 1)) {
+    MemoEntry *me = &m->entries[i];
+    if (me->epoch != m->epoch)
+      return NULL;  /* empty slot: not in table */
+    if (me->rule == rule && me->s == s)
+      return me;
+  }
+}
+
+
+/*
+** Double the memo table, moving only live entries
+*/
+static void memogrow (lua_State *L, Memo *m, int ptop) {
+  MemoEntry *old = m->entries;
+  int oldsize = m->size;
+  int i;
+  m->size *= 2;
+  m->entries = (MemoEntry *)lua_newuserdata(L, m->size * sizeof(MemoEntry));
+  memset(m->entries, 0, m->size * sizeof(MemoEntry));
+  for (i = 0; i < oldsize; i++) {
+    if (old[i].epoch == m->epoch) {
+      unsigned int j = memohash(m, old[i].rule, old[i].s);
+      while (m->entries[j].epoch == m->epoch)
+        j = (j + 1) & (m->size - 1);
+      m->entries[j] = old[i];
+    }
+  }
+  lua_replace(L, memoidx(ptop));
+}
+
+
+/*
+** Save result of 'rule' called at 's': end position 'e' (-1 for
+** failure) and the 'ncap' captures it produced
+*/
+static void memosave (lua_State *L, Memo *m, int ptop, int rule, int s,
+                      int e, const Capture *cap, int ncap) {
+  MemoEntry *me;
+  unsigned int i;
+  if (m->ncaps + ncap > MEMOMAXCAPS ||
+      (m->n + 1 > m->size / 2 && m->size >= MEMOMAXSIZE))
+    memoflush(m);  /* too big; start again */
+  else if (m->n + 1 > m->size / 2)
+    memogrow(L, m, ptop);
+  if (m->ncaps + ncap > m->capsize) {
+    Capture *newc;
+    int newsize = m->capsize * 2;
+    while (newsize < m->ncaps + ncap) newsize *= 2;
+    newc = (Capture *)lua_newuserdata(L, newsize * sizeof(Capture));
+    memcpy(newc, m->caps, m->ncaps * sizeof(Capture));
+    lua_replace(L, memocapidx(ptop));
+    m->caps = newc;
+    m->capsize = newsize;
+  }
+  i = memohash(m, rule, s);
+  while (m->entries[i].epoch == m->epoch &&
+         !(m->entries[i].rule == rule && m->entries[i].s == s))
+    i = (i + 1) & (m->size - 1);
+  me = &m->entries[i];
+  if (me->epoch != m->epoch) m->n++;
+  me->rule = rule; me->s = s; me->e = e;
+  me->epoch = m->epoch;
+  me->cap = m->ncaps; me->ncap = ncap;
+  if (ncap > 0)
+    memcpy(m->caps + m->ncaps, cap, ncap * sizeof(Capture));
+  m->ncaps += ncap;
+}
+
+/*
+** Called after a match-time capture: may the function have changed
+** grammar state?
+*/
+static int memochanged (lua_State *L, Memo *m) {
+  lua_Integer state;
+  if (!m->tracked) return 1;  /* any function may change anything */
+  state = memostate(L);
+  if (state == m->state) return 0;
+  m->state = state;
+  return 1;
+}
+
+/* }====================================================== */
+
+
 /*
 ** Interpret the result of a dynamic capture: false -> fail;
 ** true -> keep current position; number -> next position.
@@ -166,8 +354,10 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
   int captop = 0;  /* point to first empty slot in captures */
   int ndyncap = 0;  /* number of dynamic captures (in Lua stack) */
   const Instruction *p = op;  /* current instruction */
+  Memo memo;
   stack->p = &giveup; stack->s = s; stack->caplevel = 0; stack++;
   lua_pushlightuserdata(L, stackbase);
+  memoinit(L, &memo);
   for (;;) {
 #if defined(DEBUG)
       printf("-------------------------------------\n");
@@ -176,7 +366,7 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
              s, (int)(stack - getstackbase(L, ptop)), ndyncap, captop);
       printinst(op, p);
 #endif
-    assert(stackidx(ptop) + ndyncap == lua_gettop(L) && ndyncap <= captop);
+    assert(memocapidx(ptop) + ndyncap == lua_gettop(L) && ndyncap <= captop);
     switch ((Opcode)p->i.code) {
       case IEnd: {
         assert(stack == getstackbase(L, ptop) + 1);
@@ -191,6 +381,9 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
       case IRet: {
         assert(stack > getstackbase(L, ptop) && (stack - 1)->s == NULL);
         p = (--stack)->p;
+        if (memo.entries != NULL && stack->stamp == memo.stamp)
+          memosave(L, &memo, ptop, calltarget(p) - op, stack->callpos - o,
+                   s - o, capture + stack->caplevel, captop - stack->caplevel);
         continue;
       }
       case IAny: {
@@ -234,10 +427,7 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         continue;
       }
       case ISpan: {
-        for (; s < e; s++) {
-          int c = (byte)*s;
-          if (!testchar((p+1)->buff, c)) break;
-        }
+        s = spanset(s, e, (p+1)->buff);
         p += CHARSETINSTSIZE;
         continue;
       }
@@ -256,10 +446,26 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         continue;
       }
       case ICall: {
+        if (memo.entries != NULL) {
+          MemoEntry *me = memofind(&memo, (p + getoffset(p)) - op, s - o);
+          if (me != NULL) {  /* rule already tried here? */
+            if (me->e < 0) goto fail;
+            capture = growcap(L, capture, &capsize, captop, me->ncap, ptop);
+            memcpy(capture + captop, memo.caps + me->cap,
+                   me->ncap * sizeof(Capture));
+            captop += me->ncap;
+            s = o + me->e;
+            p += 2;
+            continue;
+          }
+        }
         if (stack == stacklimit)
           stack = doublestack(L, &stacklimit, ptop);
         stack->s = NULL;
         stack->p = p + 2;  /* save return address */
+        stack->callpos = s;
+        stack->caplevel = captop;
+        stack->stamp = memo.stamp;
         stack++;
         p += getoffset(p);
         continue;
@@ -293,6 +499,9 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         do {  /* remove pending calls */
           assert(stack > getstackbase(L, ptop));
           s = (--stack)->s;
+          if (s == NULL && memo.entries != NULL && stack->stamp == memo.stamp)
+            memosave(L, &memo, ptop, calltarget(stack->p) - op,
+                     stack->callpos - o, -1, NULL, 0);
         } while (s == NULL);
         if (ndyncap > 0)  /* is there matchtime captures? */
           ndyncap -= removedyncap(L, capture, stack->caplevel, captop);
@@ -313,6 +522,8 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         captop -= n;  /* remove nested captures */
         ndyncap -= rem;  /* update number of dynamic captures */
         fr -= rem;  /* 'rem' items were popped from Lua stack */
+        if (memo.entries != NULL && memochanged(L, &memo))
+          memoflush(&memo);
         res = resdyncaptures(L, fr, s - o, e - o);  /* get result */
         if (res == -1)  /* fail? */
           goto fail;
@@ -322,6 +533,7 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         if (n == 0)  /* no new captures? */
           captop--;  /* remove open group */
         else {  /* new captures; keep original open group */
+          memo.stamp++;  /* values live in Lua stack; rules can't keep them */
           if (fr + n >= SHRT_MAX)
             luaL_error(L, "too many results in match-time capture");
           /* add new captures + close group to 'capture' list */
@@ -0,0 +1,32 @@
+/*
+** Runs test.lua with this build of lpeg linked in (used by ctest)
+*/
+
+#include <stdio.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+int luaopen_lpeg (lua_State *L);
+
+
+int main (int argc, char **argv) {
+  int status;
+  lua_State *L = luaL_newstate();
+  if (L == NULL) {
+    fprintf(stderr, "cannot create state\n");
+    return 1;
+  }
+  luaL_openlibs(L);
+  luaL_getsubtable(L, LUA_REGISTRYINDEX, "_PRELOAD");
+  lua_pushcfunction(L, luaopen_lpeg);
+  lua_setfield(L, -2, "lpeg");
+  lua_pop(L, 1);
+  status = luaL_dofile(L, argc > 1 ? argv[1] : "test.lua");
+  if (status != LUA_OK)
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+  lua_close(L);
+  return status == LUA_OK ? 0 : 1;
+}
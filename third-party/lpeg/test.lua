@@ -988,6 +988,202 @@ end
 print"+"
 
 
+-- tests for packrat mode (lpeg.setmemo)
+do
+  -- results must not depend on memo table
+  local function memoeq (p, s)
+    m.setmemo(false)
+    local plain = {m.match(p, s)}
+    m.setmemo(true)
+    local memo = {m.match(p, s)}
+    m.setmemo(false)
+    checkeq(plain, memo)
+    return unpack(memo)
+  end
+
+  local exp = m.P{ "E",
+    E = m.V"T" * "+" * m.V"E" + m.V"T" * "-" * m.V"E" + m.V"T",
+    T = m.C("(" * m.V"E" * ")") + m.C(m.R"09"^1),
+  }
+  for _, s in ipairs{"1", "1+2", "(1+2)-3", "((((1))))", "((1+2)-(3+(4-5)))",
+                     "(1+", "1+-2", ""} do
+    memoeq(exp, s)
+    memoeq(m.Ct(exp), s)
+  end
+  assert(memoeq(exp, "(1+2)-3") == "(1+2)")
+
+  -- remembered captures are replayed after backtracking
+  local words = m.P{ "S",
+    S = m.V"X" * "!" + m.V"X" * "?" + m.V"X",
+    X = m.Ct(m.Cp() * m.C(m.R"az"^1) * m.Cc("word")),
+  }
+  checkeq(memoeq(words, "abc?"), {1, "abc", "word"})
+  checkeq(memoeq(words, "abc"), {1, "abc", "word"})
+
+  local groups = m.P{ "S",
+    S = m.V"T" * "-" * m.Cb"t" + m.V"T" * m.Cb"t",
+    T = m.Cg(m.C(m.R"az"^1), "t"),
+  }
+  assert(memoeq(groups, "ab") == "ab")
+  assert(memoeq(groups, "ab-") == "ab")
+
+  -- exponential backtracking without memo table
+  local nested = m.P{ "E",
+    E = "(" * m.V"E" * ")" * "x" + "(" * m.V"E" * ")" + "a",
+  }
+  local s = string.rep("(", 14) .. "a" .. string.rep(")", 14)
+  assert(memoeq(nested, s) == #s + 1)
+  assert(memoeq(nested, s .. "x") == #s + 2)
+  assert(memoeq(nested, "(" .. s) == nil)
+
+  -- match-time captures change state rules depend on, so results
+  -- remembered before them can't be used after them
+  local level = 0
+  local push = m.Cmt(m.P"", function (_, i) level = level + 1; return i end)
+  local deep = m.Cmt(m.P"", function (_, i) return level >= 2 and i end)
+  local g = m.P{ "S",
+    S = m.V"A" * "x" + push * m.V"A" * "y" + push * m.V"A" * "z",
+    A = deep * "a" + "b",
+  }
+  for _, on in ipairs{false, true} do
+    m.setmemo(on)
+    level = 0; assert(g:match"az" == 3)
+    level = 0; assert(g:match"ay" == nil)
+    level = 0; assert(g:match"by" == 3)
+    level = 0; assert(g:match"bx" == 3)
+  end
+  m.setmemo(false)
+
+  -- same for rules which call a match-time capture through other rules
+  local seen = {}
+  local mark = m.Cmt(m.C(m.R"az"), function (_, i, c)
+    if seen[c] then return false end
+    seen[c] = true
+    return i
+  end)
+  local twice = m.P{ "S",
+    S = m.V"W" * "!" + m.V"W" * "?",
+    W = m.V"M"^1,
+    M = mark,
+  }
+  for _, on in ipairs{false, true} do
+    m.setmemo(on)
+    seen = {}; assert(twice:match"ab?" == nil)  -- letters were seen by first alternative
+    seen = {}; assert(twice:match"ab!" == 4)
+  end
+  m.setmemo(false)
+
+  -- in tracked mode match-time captures which only read state are
+  -- remembered, changes are told by lpeg.flushmemo
+  local calls = 0
+  local check = m.Cmt(m.P"", function (_, i) calls = calls + 1; return i end)
+  local reads = m.P{ "S",
+    S = m.V"A" * "x" + m.V"A" * "y",
+    A = check * "a",
+  }
+  m.setmemo(true); calls = 0; assert(reads:match"ay" == 3 and calls == 2)
+  m.setmemo(true, true); calls = 0; assert(reads:match"ay" == 3 and calls == 1)
+  m.setmemo(false); calls = 0; assert(reads:match"ay" == 3 and calls == 2)
+
+  local tpush = m.Cmt(m.P"", function (_, i)
+    level = level + 1; m.flushmemo(); return i
+  end)
+  local tg = m.P{ "S",
+    S = m.V"A" * "x" + tpush * m.V"A" * "y" + tpush * m.V"A" * "z",
+    A = deep * "a" + "b",
+  }
+  for _, on in ipairs{false, true} do
+    m.setmemo(on, true)
+    level = 0; assert(tg:match"az" == 3)
+    level = 0; assert(tg:match"ay" == nil)
+    level = 0; assert(tg:match"by" == 3)
+    level = 0; assert(tg:match"bx" == 3)
+  end
+  m.flushmemo()  -- harmless out of a match
+  m.setmemo(false)
+
+  -- values of match-time captures are not remembered with their rules
+  local upper = m.P{ "S",
+    S = m.V"U" * "x" + m.V"U" * "y" + m.V"U",
+    U = m.Cmt(m.C(m.R"az"), function (_, i, c) return i, c:upper() end),
+  }
+  for _, s in ipairs{"ay", "ax", "a", "b?"} do
+    m.setmemo(false)
+    local plain = {upper:match(s)}
+    m.setmemo(true, true)
+    local memo = {upper:match(s)}
+    m.setmemo(false)
+    checkeq(plain, memo)
+  end
+  checkeq({upper:match"ay"}, {"A"})
+end
+
+print"+"
+
+
+-- tests for charset spans (ISpan), which match long runs 16 or 32 chars
+-- at a time with SSSE3/AVX2; the first 16 chars are always tested one by one
+do
+  -- length of the run matched by 'set^0' in 's' from 'init'
+  local function span (set, s, init)
+    init = init or 1
+    return m.match(set^0 * m.Cp(), s, init) - init
+  end
+
+  local all = {}
+  for c = 0, 255 do all[#all + 1] = string.char(c) end
+  all = table.concat(all)
+
+  -- every byte value, in every lane of vectors and in both nibble tables
+  local full = m.R("\0\255")
+  assert(span(full, all) == 256)
+  assert(span(full, all .. all, 7) == 512 - 6)
+  for c = 0, 255 do
+    local ch = string.char(c)
+    local others = all:gsub(ch:gsub("%W", "%%%0"), "")
+    local lane = 16 + c % 33   -- past scalar prefix, in or right after vectors
+    -- set with a single char
+    assert(span(m.P(ch), ch:rep(lane) .. (c == 0 and "\1" or "\0") .. ch:rep(40)) == lane)
+    -- set with every char except one
+    local set = m.S(others)
+    local run = others:rep(2):sub(1, lane)
+    assert(span(set, run .. ch .. others) == lane)
+    assert(span(set, run) == lane)
+  end
+
+  -- runs around vector widths, ended by a mismatch or by the subject
+  local letters = m.R("az")
+  for n = 0, 100 do
+    local run = string.rep("abcdefghijklmnopqrstuvwxyz", 4):sub(1, n)
+    assert(span(letters, run .. "!" .. run) == n)
+    assert(span(letters, run) == n)
+    assert(span(letters, run .. "\255") == n)
+    assert(span(letters, "!" .. run, 2) == n)  -- other alignment
+  end
+  for _, n in ipairs{15, 16, 17, 31, 32, 33} do
+    -- after scalar prefix too, so vector loop sees runs of exactly n
+    local run = string.rep("x", 16 + n)
+    assert(span(letters, run .. "0") == 16 + n)
+    assert(span(letters, run) == 16 + n)
+  end
+
+  -- mismatch in the last lane of the first and second vectors
+  -- (prefix covers 1-16, SSSE3 vectors cover 17-32, 33-48, AVX2 17-48)
+  for _, last in ipairs{32, 48, 80} do
+    local s = string.rep("a", last - 1) .. "#" .. string.rep("a", 40)
+    assert(span(letters, s) == last - 1)
+  end
+
+  -- charset^0 in a grammar and with captures takes the same path
+  local ident = m.C(m.R("az", "AZ", "__") * m.R("az", "AZ", "09", "__")^0)
+  local long = "_" .. string.rep("Abc123_", 20)
+  assert(ident:match(long .. " = 1") == long)
+  assert(ident:match(long) == long)
+end
+
+print"+"
+
+
 -- tests for back references
 checkerr("back reference 'x' not found", m.match, m.Cb('x'), '')
 checkerr("back reference 'b' not found", m.match, m.Cg(1, 'a') * m.Cb('b'), 'a')
@@ -0,0 +1,258 @@
+// Ahead of time compiler of .moon/.yue files, produces the same outputs moonloader writes on the server
+// Usage: moonloader-precompile [--jobs N] [--output DIR] [--report FILE] [lua directory]
+// Outputs keep layout of lua directory and are written into cache/moonloader/lua by default.
+// Report is JSON with timings and line maps (lua line -> source line) of every file, it is printed to stdout if no file is given.
+// Manifest with source hashes is written next to outputs, moonloader trusts outputs of unchanged sources instead of compiling them again.
+// Exit code is 1 if any file failed to compile or manifest couldn't be written
+
+#include "compile_cache.hpp"
+#include "manifest.hpp"
+#include "yuescript.hpp"
+
+#include <moonengine/pool.hpp>
+#include <yuescript/yue_compiler.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <unordered_set>
+#include <optional>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+using namespace MoonLoader;
+
+inline double timestamp() {
+    using clock = std::chrono::steady_clock;
+    using dur = std::chrono::duration<double, std::milli>;
+    return std::chrono::time_point_cast<dur>(clock::now()).time_since_epoch().count();
+}
+
+struct FileResult {
+    std::string source; // relative to lua directory
+    std::string output;
+    std::string language;
+    size_t bytes = 0;
+    double compile_time = 0; // in millis
+    std::optional<std::string> error;
+    std::map<int, int> line_map;
+    CompileCache::Key key;
+    uint64_t output_hash = 0;
+};
+
+bool ReadFile(const fs::path& path, std::string& content) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return false;
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    content = buffer.str();
+    return true;
+}
+
+bool WriteFile(const fs::path& path, std::string_view content) {
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) return false;
+    file.write(content.data(), content.size());
+    return static_cast<bool>(file);
+}
+
+// Must match Compiler::GetSourceKey, otherwise moonloader never trusts precompiled files
+CompileCache::Key GetSourceKey(const fs::path& input, const std::string& path, std::string_view code) {
+    if (fs::path(path).extension() != ".yue")
+        return CompileCache::MoonscriptKey(code);
+
+    yue::YueConfig config;
+    Yuescript::DefaultConfig(config);
+
+    uint64_t imports_hash = 0;
+    if (Yuescript::MayUseMacros(code)) {
+        std::unordered_set<std::string> visited = {path};
+        imports_hash = Yuescript::HashImports(path, code,
+            [&input](const std::string& import_path) {
+                std::error_code ec;
+                return fs::is_regular_file(input / import_path, ec);
+            },
+            [&input](const std::string& import_path) {
+                std::string import_code;
+                ReadFile(input / import_path, import_code);
+                return import_code;
+            },
+            visited, 0);
+    }
+    return CompileCache::YuescriptKey(code, config, imports_hash);
+}
+
+// Runs on engine worker thread
+FileResult CompileFile(MoonEngine::Engine& engine, const fs::path& input, const fs::path& output, const fs::path& relative) {
+    FileResult result;
+    result.source = relative.generic_string();
+    fs::path output_relative = relative;
+    output_relative.replace_extension(".lua");
+    result.output = output_relative.generic_string();
+
+    std::string code;
+    if (!ReadFile(input / relative, code)) {
+        result.error = "failed to read source file";
+        return result;
+    }
+    result.bytes = code.size();
+    result.key = GetSourceKey(input, result.source, code);
+
+    std::optional<CompileCache::Entry> entry;
+    double start = timestamp();
+    if (relative.extension() == ".yue") {
+        result.language = "yuescript";
+        yue::YueConfig config;
+        Yuescript::DefaultConfig(config);
+        auto info = Yuescript::Compile(code, config);
+        if (info.error) result.error = std::move(info.error->displayMessage);
+        else entry = CompileCache::Entry::FromYuescript(std::move(info.codes));
+    } else {
+        result.language = "moonscript";
+        auto info = engine.CompileString2(code);
+        if (info.error) result.error = std::move(info.error->display_msg);
+        else entry = CompileCache::Entry::FromMoonscript(std::move(info));
+    }
+    result.compile_time = timestamp() - start;
+    if (!entry) return result;
+
+    // Same line map as Compiler::WriteCompiledFile builds
+    for (const auto& [lua_line, pos] : entry->posmap)
+        result.line_map[lua_line] = pos.line;
+    result.output_hash = CompileCache::Hash(entry->lua_code);
+
+    if (!WriteFile(output / output_relative, entry->lua_code))
+        result.error = "failed to write output file";
+    return result;
+}
+
+std::string JSONString(std::string_view str) {
+    std::string result = "\"";
+    for (char c : str) {
+        switch (c) {
+            case '"': result += "\\\""; break;
+            case '\\': result += "\\\\"; break;
+            case '\n': result += "\\n"; break;
+            case '\r': result += "\\r"; break;
+            case '\t': result += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char buffer[8];
+                    snprintf(buffer, sizeof(buffer), "\\u%04x", static_cast<unsigned char>(c));
+                    result += buffer;
+                } else result += c;
+        }
+    }
+    return result + "\"";
+}
+
+void PrintReport(FILE* out, size_t jobs, double construction_time, double total_time, const std::vector<FileResult>& results) {
+    size_t failures = 0, bytes = 0;
+    for (const auto& r : results) {
+        if (r.error) failures++;
+        bytes += r.bytes;
+    }
+
+    fprintf(out, "{\n  \"jobs\": %zu,\n  \"engine_construction_ms\": %.3f,\n  \"total_ms\": %.3f,\n", jobs, construction_time, total_time);
+    fprintf(out, "  \"files\": %zu,\n  \"failures\": %zu,\n  \"bytes\": %zu,\n  \"results\": [\n", results.size(), failures, bytes);
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto& r = results[i];
+        fprintf(out, "    {\"source\": %s, \"output\": %s, \"language\": \"%s\", \"bytes\": %zu, \"compile_ms\": %.4f, \"error\": %s, \"line_map\": {",
+            JSONString(r.source).c_str(), JSONString(r.output).c_str(), r.language.c_str(), r.bytes, r.compile_time,
+            r.error ? JSONString(*r.error).c_str() : "null");
+        bool first = true;
+        for (const auto& [lua_line, source_line] : r.line_map) {
+            fprintf(out, "%s\"%d\": %d", first ? "" : ", ", lua_line, source_line);
+            first = false;
+        }
+        fprintf(out, "}}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char** argv) {
+    size_t jobs = 0;
+    fs::path input = "lua";
+    fs::path output = "cache/moonloader/lua";
+    std::optional<fs::path> report;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) jobs = std::stoul(argv[++i]);
+        else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) output = argv[++i];
+        else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc) report = argv[++i];
+        else input = argv[i];
+    }
+
+    std::error_code ec;
+    if (!fs::is_directory(input, ec)) {
+        fprintf(stderr, "%s is not a directory\n", input.string().c_str());
+        return 1;
+    }
+
+    std::vector<fs::path> files;
+    for (const auto& entry : fs::recursive_directory_iterator(input, ec)) {
+        auto ext = entry.path().extension();
+        if (entry.is_regular_file() && (ext == ".moon" || ext == ".yue"))
+            files.push_back(fs::relative(entry.path(), input));
+    }
+    std::sort(files.begin(), files.end());
+
+    double total_time = timestamp();
+    double construction_time = timestamp();
+    MoonEngine::EnginePool pool(jobs);
+    construction_time = timestamp() - construction_time;
+
+    // Workers read, compile and write files on their own, we only collect results
+    std::vector<std::future<FileResult>> pending;
+    pending.reserve(files.size());
+    for (const auto& relative : files) {
+        pending.push_back(pool.Run([&input, &output, relative](MoonEngine::Engine& engine) {
+            return CompileFile(engine, input, output, relative);
+        }));
+    }
+
+    std::vector<FileResult> results;
+    results.reserve(pending.size());
+    size_t failures = 0;
+    for (auto& result : pending) {
+        results.push_back(result.get());
+        if (const auto& r = results.back(); r.error) {
+            failures++;
+            fprintf(stderr, "%s: %s\n", r.source.c_str(), r.error->c_str());
+        }
+    }
+    total_time = timestamp() - total_time;
+
+    std::vector<Manifest::Entry> manifest;
+    for (const auto& r : results) {
+        if (r.error) continue;
+        manifest.push_back({r.source, r.key, r.output_hash, r.line_map});
+    }
+    bool manifest_written = WriteFile(output / Manifest::FILE_NAME, Manifest::Serialize(manifest));
+    if (!manifest_written)
+        fprintf(stderr, "failed to write %s\n", (output / Manifest::FILE_NAME).string().c_str());
+
+    if (report) {
+        FILE* out = fopen(report->string().c_str(), "w");
+        if (!out) {
+            fprintf(stderr, "failed to open %s\n", report->string().c_str());
+            return 1;
+        }
+        PrintReport(out, pool.Size(), construction_time, total_time, results);
+        fclose(out);
+    } else {
+        PrintReport(stdout, pool.Size(), construction_time, total_time, results);
+    }
+
+    fprintf(stderr, "compiled %zu of %zu files in %.1f ms using %zu threads\n",
+        files.size() - failures, files.size(), total_time, pool.Size());
+    return failures > 0 || !manifest_written ? 1 : 0;
+}
@@ -0,0 +1,125 @@
+// Compiles a file importing macros, edits the macro module and compiles the file again on the same thread, used by ctest.
+// Compiler of the thread is reused, so it must not keep serving macros of the old module.
+// Auto-reload of an edited module which only defines macros must recompile its importers, though its own lua stays the same
+
+#include "yuescript.hpp"
+#include "compile_cache.hpp"
+#include "reload_plan.hpp"
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <unordered_set>
+#include <yuescript/yue_compiler.h>
+
+namespace fs = std::filesystem;
+using namespace MoonLoader;
+
+static bool WriteFile(const fs::path& path, const std::string& content) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file << content;
+    return static_cast<bool>(file);
+}
+
+static std::string ReadFile(const fs::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream stream;
+    stream << file.rdbuf();
+    return stream.str();
+}
+
+struct Compiled {
+    CompileCache::Key key;
+    std::string lua_code; // Can be empty for modules which only define macros
+    bool ok = false;
+};
+
+// Same steps as Compiler: source key (which hashes imports) is computed before compilation
+static Compiled CompileSource(const std::string& path, const std::string& code) {
+    yue::YueConfig config;
+    Yuescript::DefaultConfig(config);
+
+    std::unordered_set<std::string> visited = {path};
+    uint64_t imports_hash = Yuescript::HashImports(path, code,
+        [](const std::string& import_path) { return fs::is_regular_file(import_path); },
+        [](const std::string& import_path) { return ReadFile(import_path); },
+        visited, 0);
+
+    Compiled compiled;
+    compiled.key = CompileCache::YuescriptKey(code, config, imports_hash);
+    auto info = Yuescript::Compile(code, config);
+    if (info.error)
+        fprintf(stderr, "FAIL: compilation of %s failed:\n%s\n", path.c_str(), info.error->displayMessage.c_str());
+    else
+        compiled.lua_code = std::move(info.codes);
+    compiled.ok = !info.error;
+    return compiled;
+}
+
+static std::string MacroModule(const char* greeting) {
+    return std::string("export macro greeting = -> '\"") + greeting + "\"'\n";
+}
+
+int main() {
+    // Macro modules are found relative to the working directory
+    fs::path dir = fs::temp_directory_path() / "moonloader_yuescript_test";
+    std::error_code ec;
+    fs::remove_all(dir, ec);
+    fs::create_directories(dir);
+    fs::current_path(dir);
+
+    const std::string importer = "import \"macros\" as {$greeting}\nprint $greeting!\n";
+    int failures = 0;
+    Compiled module, importer_compiled;
+    for (const char* greeting : {"hello", "goodbye", "welcome back"}) {
+        if (!WriteFile("macros.yue", MacroModule(greeting))) {
+            fprintf(stderr, "FAIL: couldn't write macros.yue into %s\n", dir.string().c_str());
+            return 1;
+        }
+
+        // Watchdog compiles the edited module first, its importers are recompiled after that
+        auto previous_module = module;
+        auto previous_importer = importer_compiled;
+        module = CompileSource("macros.yue", MacroModule(greeting));
+        importer_compiled = CompileSource("importer.yue", importer);
+        if (!module.ok || !importer_compiled.ok) {
+            failures++;
+            continue;
+        }
+        if (importer_compiled.lua_code.find(greeting) == std::string::npos) {
+            fprintf(stderr, "FAIL: expansion of '%s' expected, got:\n%s\n", greeting, importer_compiled.lua_code.c_str());
+            failures++;
+        }
+        if (!previous_module.ok) continue; // First version
+
+        auto plan = ReloadPlan::Make(previous_module.key, CompileCache::Hash(previous_module.lua_code),
+                                     module.key, CompileCache::Hash(module.lua_code));
+        if (module.lua_code != previous_module.lua_code || plan.refresh_source) {
+            fprintf(stderr, "FAIL: macro-only module was expected to compile into the same lua:\n%s\n", module.lua_code.c_str());
+            failures++;
+        }
+        if (!plan.recompile_dependents) {
+            fprintf(stderr, "FAIL: importers of macro module edited to '%s' aren't recompiled\n", greeting);
+            failures++;
+        }
+        // Compiler skips files whose key didn't change
+        if (importer_compiled.key == previous_importer.key) {
+            fprintf(stderr, "FAIL: key of importer didn't change after macro module was edited to '%s'\n", greeting);
+            failures++;
+        }
+    }
+
+    // Only touched module
+    auto touched = CompileSource("macros.yue", ReadFile("macros.yue"));
+    if (!ReloadPlan::Make(module.key, CompileCache::Hash(module.lua_code), touched.key, CompileCache::Hash(touched.lua_code)).Empty()) {
+        fprintf(stderr, "FAIL: unchanged macro module triggers auto-reload\n");
+        failures++;
+    }
+
+    fs::current_path(fs::temp_directory_path());
+    fs::remove_all(dir, ec);
+    if (failures > 0) return 1;
+    printf("edited macro modules are imported again and their importers are recompiled\n");
+    return 0;
+}